@@ -1,53 +1,86 @@
-#pragma once
-
-#include <cstdlib>
-#include <new>
-#include <iostream>
-#include <memory>
-
-class ArenaAllocator {
-public:
-
-    inline explicit ArenaAllocator(size_t bytes) : size(bytes) {
-
-        buffer = static_cast<byte*>(std::malloc(size));
-
-        if (!buffer) {
-            cerr << "Memory allocation failed!" << endl;
-            exit(EXIT_FAILURE);
-        }
-
-        offset = buffer;
-
-    }
-
-    // Deleted copy constructor and assignment operator to prevent copying
-    inline ArenaAllocator(const ArenaAllocator& other) = delete;
-    inline ArenaAllocator& operator=(const ArenaAllocator& other) = delete;
-
-    inline ~ArenaAllocator() { // Destructor
-        free(buffer);
-    }
-
-    // Allocate memory for a type T with proper alignment
-    template <typename T>
-    inline T* allocate() {
-        std::size_t alignment = alignof(T);
-        std::size_t space = size - (offset - buffer);
-
-        void* aligned_ptr = offset;
-
-        if (align(alignment, sizeof(T), aligned_ptr, space)) {
-            offset = static_cast<byte*>(aligned_ptr) + sizeof(T);
-            return static_cast<T*>(aligned_ptr);
-        } else {
-            cerr << "ArenaAllocator: Out of memory or alignment error!" << endl;
-            exit(EXIT_FAILURE);
-        }
-    }
-
-private:
-    size_t size;    // Size of the buffer
-    byte* buffer;   // Pointer to the buffer
-    byte* offset;   // Pointer to the current offset
-};
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+class ArenaAllocator {
+public:
+
+    inline explicit ArenaAllocator(size_t bytes) : size(bytes) {
+        allocateBuffer();
+    }
+
+    // Deleted copy constructor and assignment operator to prevent copying
+    inline ArenaAllocator(const ArenaAllocator& other) = delete;
+    inline ArenaAllocator& operator=(const ArenaAllocator& other) = delete;
+
+    inline ~ArenaAllocator() { // Destructor
+        for (size_t i = destructors.size(); i > 0; i--) destructors[i - 1].destroy(destructors[i - 1].object);
+        for (byte* full : fullBuffers) free(full);
+        free(buffer);
+    }
+
+    // Allocate and value-initialize a T with proper alignment
+    template <typename T>
+    inline T* allocate() {
+        std::size_t alignment = alignof(T);
+        std::size_t space = size - (offset - buffer);
+
+        void* aligned_ptr = offset;
+
+        if (!align(alignment, sizeof(T), aligned_ptr, space)) {
+
+            // Continue in a fresh buffer of the same size, the full one stays alive until destruction
+            fullBuffers.push_back(buffer);
+            allocateBuffer();
+
+            aligned_ptr = offset;
+            space = size;
+
+            if (!align(alignment, sizeof(T), aligned_ptr, space)) {
+                cerr << "ArenaAllocator: Out of memory or alignment error!" << endl;
+                exit(EXIT_FAILURE);
+            }
+
+        }
+
+        offset = static_cast<byte*>(aligned_ptr) + sizeof(T);
+        T* object = new (aligned_ptr) T();
+
+        // Nodes holding vectors own heap memory, which has to be released along with the arena
+        if constexpr (!is_trivially_destructible_v<T>) {
+            destructors.push_back({ .object = object, .destroy = [](void* pointer){ static_cast<T*>(pointer)->~T(); } });
+        }
+
+        return object;
+    }
+
+private:
+    void allocateBuffer() {
+
+        buffer = static_cast<byte*>(std::malloc(size));
+
+        if (!buffer) {
+            cerr << "Memory allocation failed!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        offset = buffer;
+
+    }
+
+    struct Destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    std::vector<Destructor> destructors;
+    std::vector<byte*> fullBuffers; // Buffers that ran out of space
+    size_t size;    // Size of the buffer
+    byte* buffer;   // Pointer to the buffer
+    byte* offset;   // Pointer to the current offset
+};
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Compares running a program from its source, which lexes, parses, optimizes and compiles it every time,
+# with running the module saved by --emit-bytecode, which is only mapped and validated.
+#
+# Usage: benchmarks/module_load.sh <compiler> [statements] [runs]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [statements] [runs]}")"
+statements="${2:-200000}"
+runs="${3:-5}"
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# Scoped lets keep the variable lookups short, so the time goes into the front end and not into name resolution
+awk -v n="$statements" 'BEGIN {
+    print "let acc = 0;"
+    for (i = 0; i < n; i++) printf "{ let x = %d; acc = acc + x * 3 - (x / 2); }\n", i
+    print "exit acc;"
+}' > "$work/program.n"
+
+"$compiler" "$work/program.n" "--emit-bytecode=$work/program.nbc" || exit 1
+
+milliseconds() {
+    local start end
+    start=$(date +%s%N)
+    for ((i = 0; i < runs; i++)); do "$@"; done
+    end=$(date +%s%N)
+    echo $(((end - start) / 1000000 / runs))
+}
+
+source_time=$(milliseconds "$compiler" "$work/program.n" --run)
+module_time=$(milliseconds "$compiler" "$work/program.nbc")
+
+echo "$statements statements, $(stat -c %s "$work/program.n") bytes of source, $(stat -c %s "$work/program.nbc") bytes of module"
+echo "reparse and run: ${source_time} ms"
+echo "mapped module:   ${module_time} ms"
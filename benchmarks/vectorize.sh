@@ -0,0 +1,94 @@
+#!/bin/bash
+# Runs the same programs compiled scalar, with -msse2 and with -mavx2. Each program calls a kernel of four
+# independent chains of lets, which the vectorizer packs into one group per round, 2^depth times:
+#   add       only additions and subtractions
+#   mixed     every fourth round multiplies
+#   multiply  every round multiplies
+# The fastest of `runs` runs is reported, all builds have to exit with the same code.
+#
+# Usage: benchmarks/vectorize.sh <compiler> [depth] [runs]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [depth] [runs]}")"
+depth="${2:-20}"
+runs="${3:-5}"
+
+assemble="$(realpath "$(dirname "$0")/../tests/assemble.sh")"
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+generate() {
+    awk -v kind="$1" -v depth="$depth" -v rounds=40 'BEGIN {
+        split("a b c d", v, " ")
+        print "fn kernel(a0, b0, c0, d0) {"
+        for (r = 1; r <= rounds; r++) {
+            multiply = kind == "multiply" || (kind == "mixed" && r % 4 == 0)
+            for (k = 1; k <= 4; k++) {
+                x = v[k] (r - 1); y = v[k] (r > 1 ? r - 2 : 0)
+                if (multiply) printf "    let %s%d = %s * %s + %d;\n", v[k], r, x, y, r
+                else if (r % 2) printf "    let %s%d = %s + %s + %d;\n", v[k], r, x, x, r
+                else printf "    let %s%d = %s - %s + %s;\n", v[k], r, x, y, x
+            }
+        }
+        printf "    return a%d + b%d + c%d + d%d;\n}\n", rounds, rounds, rounds, rounds
+        print "fn run(depth, x) {"
+        print "    if depth {"
+        print "        return run(depth - 1, x) + run(depth - 1, x + 1);"
+        print "    }"
+        print "    return kernel(x, x + 1, x + 2, x + 3);"
+        print "}"
+        printf "exit run(%d, 1) + 7;\n", depth
+    }' > "$work/$1.n"
+}
+
+fastest() {
+    local best="" start end elapsed
+    for ((i = 0; i < runs; i++)); do
+        start=$(date +%s%N)
+        "$1"
+        end=$(date +%s%N)
+        elapsed=$(((end - start) / 1000000))
+        [ -z "$best" ] || [ "$elapsed" -lt "$best" ] && best=$elapsed
+    done
+    echo "$best"
+}
+
+isas=("" -msse2)
+grep -qw avx2 /proc/cpuinfo && isas+=(-mavx2)
+
+failures=0
+
+printf "%-10s %10s %10s %10s\n" program scalar sse2 avx2
+
+for kind in add mixed multiply; do
+
+    generate "$kind"
+    line="$(printf "%-10s" "$kind")"
+    expected=""
+
+    for isa in "${isas[@]}"; do
+
+        "$compiler" "$work/$kind.n" $isa > /dev/null || exit 1
+        "$assemble" ../out.asm "$work/$kind$isa" || exit 1
+
+        "$work/$kind$isa"
+        code=$?
+        [ -z "$expected" ] && expected=$code
+        if [ "$code" -ne "$expected" ]; then
+            echo "FAIL $kind $isa: exited with $code, the scalar build with $expected"
+            failures=$((failures + 1))
+        fi
+
+        line+="$(printf " %8s ms" "$(fastest "$work/$kind$isa")")"
+
+    done
+
+    echo "$line"
+
+done
+
+exit $((failures > 0))
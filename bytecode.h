@@ -0,0 +1,680 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <algorithm>
+#include <map>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "parser.h"
+
+enum class OpCode : uint32_t {
+    LOAD_CONSTANT,  // r[a] = constants[b]
+    MOVE,           // r[a] = r[b]
+
+    ADD,            // r[a] = r[b] + r[c]
+    SUBTRACT,       // r[a] = r[b] - r[c]
+    MULTIPLY,       // r[a] = r[b] * r[c]
+    DIVIDE,         // r[a] = r[b] / r[c]
+
+    JUMP,           // pc = a
+    JUMP_IF_ZERO,   // if r[a] == 0: pc = b
+
+    CALL,           // r[a] = functions[b](r[c], r[c + 1], ...)
+    RETURN,         // return r[a]
+    EXIT            // exit r[a]
+};
+
+// Fixed size and pointer free, so code can be stored and loaded as is
+struct Instruction {
+    OpCode op {};
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+struct FunctionInfo {
+    uint32_t entry = 0;         // Index of the first instruction
+    uint32_t parameters = 0;    // Arguments arrive in the first registers
+    uint32_t registers = 0;     // Size of the register window
+
+    // Bounds the memory a single window takes, larger ones in a module file are rejected
+    static constexpr uint32_t maxRegisters = 1 << 24;
+};
+
+// Non owning view of compiled code, function 0 is the program itself
+struct Bytecode {
+    span<const Instruction> code;
+    span<const uint64_t> constants;
+    span<const FunctionInfo> functions;
+};
+
+// Module files hold the header followed by the code, constants and functions arrays, in native byte order.
+// Every array starts at a multiple of its alignment, so a mapped file can be used without copying.
+struct ModuleHeader {
+    static constexpr char expectedMagic[4] = { 'N', 'B', 'C', '\0' };
+    static constexpr uint32_t currentVersion = 1;
+
+    char magic[4] {};
+    uint32_t version = 0;
+    uint32_t codeCount = 0;
+    uint32_t constantCount = 0;
+    uint32_t functionCount = 0;
+    uint32_t reserved = 0;
+};
+
+static_assert(sizeof(ModuleHeader) % alignof(uint64_t) == 0 && sizeof(Instruction) % alignof(uint64_t) == 0);
+
+struct Module {
+    vector<Instruction> code;
+    vector<uint64_t> constants;
+    vector<FunctionInfo> functions;
+
+    [[nodiscard]] Bytecode view() const {
+        return { .code = code, .constants = constants, .functions = functions };
+    }
+
+    void save(const string& path) const {
+
+        ModuleHeader header {
+            .version = ModuleHeader::currentVersion,
+            .codeCount = (uint32_t) code.size(),
+            .constantCount = (uint32_t) constants.size(),
+            .functionCount = (uint32_t) functions.size()
+        };
+        copy(begin(ModuleHeader::expectedMagic), end(ModuleHeader::expectedMagic), header.magic);
+
+        ofstream file(path, ios::out | ios::binary | ios::trunc);
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(code.data()), (streamsize) (code.size() * sizeof(Instruction)));
+        file.write(reinterpret_cast<const char*>(constants.data()), (streamsize) (constants.size() * sizeof(uint64_t)));
+        file.write(reinterpret_cast<const char*>(functions.data()), (streamsize) (functions.size() * sizeof(FunctionInfo)));
+
+        if (!file) {
+            cerr << "Failed to write module '" << path << "'!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+    }
+};
+
+// A module file mapped into memory, the arrays are used in place instead of being read node by node
+class MappedModule {
+
+public:
+    inline explicit MappedModule(const string& path) {
+
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) raise("Failed to open module '" + path + "'");
+
+        struct stat status {};
+        if (fstat(descriptor, &status) != 0) raise("Failed to open module '" + path + "'");
+
+        size = (size_t) status.st_size;
+
+        // The mapping stays valid after the descriptor is closed
+        void* mapping = size >= sizeof(ModuleHeader) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+        close(descriptor);
+
+        if (mapping == MAP_FAILED) raise("Failed to map module '" + path + "'");
+        data = static_cast<const byte*>(mapping);
+
+        const auto* header = reinterpret_cast<const ModuleHeader*>(data);
+
+        if (!equal(begin(header->magic), end(header->magic), begin(ModuleHeader::expectedMagic))) raise("'" + path + "' is not a module");
+        if (header->version != ModuleHeader::currentVersion) {
+            raise("Module '" + path + "' has version " + to_string(header->version) + ", expected " + to_string(ModuleHeader::currentVersion));
+        }
+
+        size_t expectedSize = sizeof(ModuleHeader) + header->codeCount * sizeof(Instruction)
+                              + header->constantCount * sizeof(uint64_t) + header->functionCount * sizeof(FunctionInfo);
+
+        if (size != expectedSize || header->functionCount == 0) raise("Module '" + path + "' is truncated");
+
+        const byte* pointer = data + sizeof(ModuleHeader);
+
+        bytecode.code = { reinterpret_cast<const Instruction*>(pointer), header->codeCount };
+        pointer += header->codeCount * sizeof(Instruction);
+
+        bytecode.constants = { reinterpret_cast<const uint64_t*>(pointer), header->constantCount };
+        pointer += header->constantCount * sizeof(uint64_t);
+
+        bytecode.functions = { reinterpret_cast<const FunctionInfo*>(pointer), header->functionCount };
+
+        // The file may have been changed since it was written, it is only executed once every instruction is known to be safe
+        if (!isValid()) raise("Module '" + path + "' is corrupted");
+
+    }
+
+    inline MappedModule(const MappedModule& other) = delete;
+    inline MappedModule& operator=(const MappedModule& other) = delete;
+
+    inline ~MappedModule() {
+        munmap(const_cast<byte*>(data), size);
+    }
+
+    [[nodiscard]] Bytecode view() const {
+        return bytecode;
+    }
+
+private:
+
+    // Functions occupy consecutive ranges of the code in the order of their entries. Every instruction has to stay inside
+    // the register window and the code of its function, and a range can only be left through a terminator, so control
+    // never falls into another function. Function 0 is entered without a frame and must not return.
+    [[nodiscard]] bool isValid() const {
+
+        const span<const Instruction>& code = bytecode.code;
+        const span<const FunctionInfo>& functions = bytecode.functions;
+
+        for (size_t index = 0; index < functions.size(); index++) {
+
+            const FunctionInfo& function = functions[index];
+            uint64_t end = index + 1 < functions.size() ? functions[index + 1].entry : code.size();
+
+            if (function.entry >= end || end > code.size()) return false;
+            if (function.registers == 0 || function.registers > FunctionInfo::maxRegisters || function.parameters > function.registers) return false;
+
+            auto isRegister = [&](uint32_t value){ return value < function.registers; };
+            auto isTarget = [&](uint32_t value){ return value >= function.entry && value < end; };
+
+            for (uint64_t position = function.entry; position < end; position++) {
+
+                const Instruction& instruction = code[position];
+
+                switch (instruction.op) {
+
+                    case OpCode::LOAD_CONSTANT:
+                        if (!isRegister(instruction.a) || instruction.b >= bytecode.constants.size()) return false;
+                        break;
+
+                    case OpCode::MOVE:
+                        if (!isRegister(instruction.a) || !isRegister(instruction.b)) return false;
+                        break;
+
+                    case OpCode::ADD:
+                    case OpCode::SUBTRACT:
+                    case OpCode::MULTIPLY:
+                    case OpCode::DIVIDE:
+                        if (!isRegister(instruction.a) || !isRegister(instruction.b) || !isRegister(instruction.c)) return false;
+                        break;
+
+                    case OpCode::JUMP:
+                        if (!isTarget(instruction.a)) return false;
+                        break;
+
+                    case OpCode::JUMP_IF_ZERO:
+                        if (!isRegister(instruction.a) || !isTarget(instruction.b)) return false;
+                        break;
+
+                    case OpCode::CALL: {
+                        if (!isRegister(instruction.a) || instruction.b >= functions.size()) return false;
+                        uint64_t arguments = (uint64_t) instruction.c + functions[instruction.b].parameters;
+                        if (arguments > function.registers) return false;
+                        break;
+                    }
+
+                    case OpCode::RETURN:
+                        if (index == 0 || !isRegister(instruction.a)) return false;
+                        break;
+
+                    case OpCode::EXIT:
+                        if (!isRegister(instruction.a)) return false;
+                        break;
+
+                    default:
+                        return false;
+
+                }
+
+            }
+
+            OpCode last = code[end - 1].op;
+            if (last != OpCode::JUMP && last != OpCode::RETURN && last != OpCode::EXIT) return false;
+
+        }
+
+        return true;
+
+    }
+
+    [[noreturn]] static void raise(const string& message) {
+        cerr << message << "!" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const byte* data = nullptr;
+    size_t size = 0;
+    Bytecode bytecode {};
+};
+
+// Compiles the program into register based bytecode. Every variable owns a register of its function's window,
+// temporaries live above the variables of the innermost scope.
+class BytecodeCompiler {
+
+public:
+    inline explicit BytecodeCompiler(Node::Program program):
+            program(program)
+    {}
+
+    [[nodiscard]] Module compile() {
+
+        module.functions.push_back({});
+        collectFunctions();
+
+        compileBody(0, program.scope, {});
+        emit({ .op = OpCode::LOAD_CONSTANT, .a = allocateRegister(), .b = constant(0) });
+        emit({ .op = OpCode::EXIT, .a = nextRegister - 1 });
+        finishBody(0);
+
+        for (size_t i = 0; i < functions.size(); i++) {
+
+            const Node::StatementVariant::Function* definition = functions[i];
+
+            currentFunction = definition;
+            compileBody(i + 1, definition->scope, definition->parameters);
+
+            // Falling off the end of a function returns 0
+            emit({ .op = OpCode::LOAD_CONSTANT, .a = allocateRegister(), .b = constant(0) });
+            emit({ .op = OpCode::RETURN, .a = nextRegister - 1 });
+            finishBody(i + 1);
+
+        }
+
+        return std::move(module);
+
+    }
+
+private:
+
+    void collectFunctions() {
+
+        for (const Node::Statement* statement : program.scope->statements) {
+
+            auto definition = get_if<Node::StatementVariant::Function*>(&statement->variant);
+            if (!definition) continue;
+
+            if (findFunction(text((*definition)->identifierToken))) {
+                raise("Double Declaration of Function '" + text((*definition)->identifierToken) + "'");
+            }
+
+            functions.push_back(*definition);
+            module.functions.push_back({ .parameters = (uint32_t) (*definition)->parameters.size() });
+
+        }
+
+    }
+
+    void compileBody(size_t index, const Node::Scope* body, const vector<Token>& parameters) {
+
+        variables.clear();
+        nextRegister = 0;
+        maxRegister = 0;
+
+        module.functions[index].entry = (uint32_t) module.code.size();
+
+        for (const Token& parameter : parameters) {
+            if (findVariable(text(parameter))) raise("Double Declaration of Parameter '" + text(parameter) + "'");
+            variables.push_back({ .name = text(parameter), .reg = allocateRegister() });
+        }
+
+        compileScope(body);
+
+    }
+
+    void finishBody(size_t index) {
+        module.functions[index].registers = maxRegister;
+    }
+
+    // Statements are compiled from an explicit work stack, so scopes and else if chains can nest arbitrarily deep
+    struct PendingStatement {
+        enum class Step { STATEMENT, ELSE, PATCH_JUMP, PATCH_BRANCH, END_SCOPE } step;
+        const Node::Statement* statement = nullptr;  // STATEMENT and ELSE
+        size_t jump = 0;                             // Instruction whose target is the current position
+        size_t variableMark = 0;                     // END_SCOPE
+        uint32_t registerMark = 0;
+    };
+
+    void compileScope(const Node::Scope* scope) {
+
+        vector<PendingStatement> pending;
+        pushStatements(scope, pending);
+
+        while (!pending.empty()) {
+
+            PendingStatement item = pending.back();
+            pending.pop_back();
+
+            switch (item.step) {
+
+                case PendingStatement::Step::STATEMENT: {
+                    compileStatement(item.statement, pending);
+                    break;
+                }
+
+                case PendingStatement::Step::ELSE: {
+                    size_t jumpToEnd = emit({ .op = OpCode::JUMP });
+                    module.code[item.jump].b = (uint32_t) module.code.size();
+                    pending.push_back({ .step = PendingStatement::Step::PATCH_JUMP, .jump = jumpToEnd });
+                    pending.push_back({ .step = PendingStatement::Step::STATEMENT, .statement = item.statement });
+                    break;
+                }
+
+                case PendingStatement::Step::PATCH_JUMP: {
+                    module.code[item.jump].a = (uint32_t) module.code.size();
+                    break;
+                }
+
+                case PendingStatement::Step::PATCH_BRANCH: {
+                    module.code[item.jump].b = (uint32_t) module.code.size();
+                    break;
+                }
+
+                case PendingStatement::Step::END_SCOPE: {
+                    variables.resize(item.variableMark);
+                    nextRegister = item.registerMark;
+                    break;
+                }
+
+            }
+
+        }
+
+    }
+
+    static void pushStatements(const Node::Scope* scope, vector<PendingStatement>& pending) {
+        for (size_t i = scope->statements.size(); i > 0; i--) {
+            pending.push_back({ .step = PendingStatement::Step::STATEMENT, .statement = scope->statements[i - 1] });
+        }
+    }
+
+    void compileStatement(const Node::Statement* statement, vector<PendingStatement>& pending) {
+
+        if (auto exitStatement = get_if<Node::StatementVariant::Exit*>(&statement->variant)) {
+
+            uint32_t mark = nextRegister;
+            emit({ .op = OpCode::EXIT, .a = compileOperand((*exitStatement)->expression) });
+            nextRegister = mark;
+
+        }
+        else if (auto returnStatement = get_if<Node::StatementVariant::Return*>(&statement->variant)) {
+
+            if (!currentFunction) raise("Return outside of function");
+
+            uint32_t mark = nextRegister;
+            emit({ .op = OpCode::RETURN, .a = compileOperand((*returnStatement)->expression) });
+            nextRegister = mark;
+
+        }
+        else if (auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant)) {
+
+            const string& name = text((*letStatement)->identifierToken);
+            if (findVariable(name)) raise("Double Declaration of Variable '" + name + "'");
+
+            uint32_t reg = allocateRegister();
+
+            // A missing initial value is never read, see Optimizer
+            if ((*letStatement)->expression) compileExpression((*letStatement)->expression, reg);
+
+            variables.push_back({ .name = name, .reg = reg });
+
+        }
+        else if (auto assignStatement = get_if<Node::StatementVariant::Assign*>(&statement->variant)) {
+
+            auto variable = findVariable(text((*assignStatement)->identifierToken));
+            if (!variable) raise("Undeclared identifier: '" + text((*assignStatement)->identifierToken) + "'");
+
+            compileExpression((*assignStatement)->expression, variable->reg);
+
+        }
+        else if (auto ifStatement = get_if<Node::StatementVariant::If*>(&statement->variant)) {
+
+            uint32_t mark = nextRegister;
+            size_t jumpToElse = emit({ .op = OpCode::JUMP_IF_ZERO, .a = compileOperand((*ifStatement)->condition) });
+            nextRegister = mark;
+
+            if ((*ifStatement)->elseStatement.has_value()) {
+                pending.push_back({ .step = PendingStatement::Step::ELSE, .statement = (*ifStatement)->elseStatement.value(), .jump = jumpToElse });
+            } else {
+                pending.push_back({ .step = PendingStatement::Step::PATCH_BRANCH, .jump = jumpToElse });
+            }
+
+            pending.push_back({ .step = PendingStatement::Step::STATEMENT, .statement = (*ifStatement)->statement });
+
+        }
+        else if (auto function = get_if<Node::StatementVariant::Function*>(&statement->variant)) {
+
+            // Bodies are compiled separately, see compile
+            if (find(functions.cbegin(), functions.cend(), *function) == functions.cend()) {
+                raise("Function '" + text((*function)->identifierToken) + "' must be defined at top level");
+            }
+
+        }
+        else if (auto scope = get_if<Node::Scope*>(&statement->variant)) {
+            pending.push_back({ .step = PendingStatement::Step::END_SCOPE, .variableMark = variables.size(), .registerMark = nextRegister });
+            pushStatements(*scope, pending);
+        }
+
+    }
+
+    // Returns the register holding the value, variables are used in place
+    uint32_t compileOperand(const Node::Expression* expression) {
+
+        while (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            expression = (*brackets)->expression;
+        }
+
+        if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&expression->variant)) {
+            return lookup((*identifier)->value).reg;
+        }
+
+        uint32_t reg = allocateRegister();
+        compileExpression(expression, reg);
+        return reg;
+
+    }
+
+    // Expressions whose operands are still being compiled, `stage` counts the operands started so far
+    struct PendingExpression {
+        const Node::Expression* expression;
+        uint32_t target;
+        uint32_t mark = 0;   // Temporaries above it are released when the expression is done
+        size_t stage = 0;
+        uint32_t left = 0;   // Register of the left operand, or of the first argument
+        uint32_t right = 0;
+    };
+
+    void compileExpression(const Node::Expression* expression, uint32_t target) {
+
+        vector<PendingExpression> pending { { .expression = expression, .target = target } };
+
+        while (!pending.empty()) {
+
+            size_t top = pending.size() - 1;
+            const Node::Expression* current = pending[top].expression;
+
+            if (pending[top].stage == 0) pending[top].mark = nextRegister;
+
+            bool done = true;
+
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&current->variant)) {
+                emit({ .op = OpCode::MOVE, .a = pending[top].target, .b = lookup((*identifier)->value).reg });
+            }
+            else if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&current->variant)) {
+                emit({ .op = OpCode::LOAD_CONSTANT, .a = pending[top].target, .b = constant(integerValue((*integer)->value)) });
+            }
+            else if (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&current->variant)) {
+                if (pending[top].stage++ == 0) {
+                    pending.push_back({ .expression = (*brackets)->expression, .target = pending[top].target });
+                    done = false;
+                }
+            }
+            else if (auto call = get_if<Node::ExpressionVariant::Call*>(&current->variant)) {
+
+                const string& name = text((*call)->identifierToken);
+                auto index = findFunction(name);
+
+                if (pending[top].stage == 0) {
+
+                    if (!index) raise("Undeclared Function '" + name + "'");
+                    if (module.functions[index.value()].parameters != (*call)->arguments.size()) {
+                        raise("Function '" + name + "' expects " + to_string(module.functions[index.value()].parameters) + " arguments but got " + to_string((*call)->arguments.size()));
+                    }
+
+                    // Arguments are passed in consecutive registers
+                    pending[top].left = nextRegister;
+                    for (size_t i = 0; i < (*call)->arguments.size(); i++) allocateRegister();
+
+                }
+
+                size_t argument = pending[top].stage++;
+
+                if (argument < (*call)->arguments.size()) {
+                    pending.push_back({ .expression = (*call)->arguments[argument], .target = pending[top].left + (uint32_t) argument });
+                    done = false;
+                } else {
+                    emit({ .op = OpCode::CALL, .a = pending[top].target, .b = (uint32_t) index.value(), .c = pending[top].left });
+                }
+
+            }
+            else {
+
+                auto term = get<Node::ExpressionVariant::Term*>(current->variant);
+
+                auto [op, left, right] = visit([](auto* binary) {
+                    using T = remove_pointer_t<decltype(binary)>;
+                    OpCode op = OpCode::DIVIDE;
+                    if constexpr (is_same_v<T, Node::ExpressionVariant::TermVariant::Addition>) op = OpCode::ADD;
+                    if constexpr (is_same_v<T, Node::ExpressionVariant::TermVariant::Subtraction>) op = OpCode::SUBTRACT;
+                    if constexpr (is_same_v<T, Node::ExpressionVariant::TermVariant::Multiplication>) op = OpCode::MULTIPLY;
+                    return tuple<OpCode, const Node::Expression*, const Node::Expression*> { op, binary->left, binary->right };
+                }, term->variant);
+
+                size_t stage = pending[top].stage++;
+
+                if (stage == 0) {
+                    pending[top].left = startOperand(left, pending);
+                    done = false;
+                }
+                else if (stage == 1) {
+                    pending[top].right = startOperand(right, pending);
+                    done = false;
+                }
+                else {
+                    emit({ .op = op, .a = pending[top].target, .b = pending[top].left, .c = pending[top].right });
+                }
+
+            }
+
+            if (done) {
+                nextRegister = pending[top].mark;
+                pending.pop_back();
+            }
+
+        }
+
+    }
+
+    // Like compileOperand, but queues the compilation instead of recursing
+    uint32_t startOperand(const Node::Expression* expression, vector<PendingExpression>& pending) {
+
+        while (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            expression = (*brackets)->expression;
+        }
+
+        if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&expression->variant)) {
+            return lookup((*identifier)->value).reg;
+        }
+
+        uint32_t reg = allocateRegister();
+        pending.push_back({ .expression = expression, .target = reg });
+        return reg;
+
+    }
+
+    size_t emit(Instruction instruction) {
+        module.code.push_back(instruction);
+        return module.code.size() - 1;
+    }
+
+    uint32_t constant(uint64_t value) {
+
+        auto [it, inserted] = constants.try_emplace(value, (uint32_t) module.constants.size());
+        if (inserted) module.constants.push_back(value);
+
+        return it->second;
+
+    }
+
+    map<uint64_t, uint32_t> constants {}; // Index of every value in the constant pool
+
+    uint32_t allocateRegister() {
+        if (nextRegister == FunctionInfo::maxRegisters) {
+            cerr << "Function needs more than " << FunctionInfo::maxRegisters << " registers!" << endl;
+            exit(EXIT_FAILURE);
+        }
+        maxRegister = max(maxRegister, nextRegister + 1);
+        return nextRegister++;
+    }
+
+    // Variables
+    struct Variable {
+        string name;
+        uint32_t reg;
+    };
+    vector<Variable> variables {};
+    uint32_t nextRegister = 0;
+    uint32_t maxRegister = 0;
+
+    const Variable* findVariable(const string& name) const {
+        auto it = find_if(variables.cbegin(), variables.cend(), [&](const Variable& variable){ return variable.name == name; });
+        return it != variables.cend() ? &*it : nullptr;
+    }
+
+    const Variable& lookup(const Token& token) const {
+        auto variable = findVariable(text(token));
+        if (!variable) raise("Undeclared Variable '" + text(token) + "'");
+        return *variable;
+    }
+
+    // Functions, their index in the module is one higher
+    vector<const Node::StatementVariant::Function*> functions {};
+    const Node::StatementVariant::Function* currentFunction = nullptr;
+
+    optional<size_t> findFunction(const string& name) const {
+        for (size_t i = 0; i < functions.size(); i++) {
+            if (text(functions[i]->identifierToken) == name) return i + 1;
+        }
+        return {};
+    }
+
+    // Errors
+    [[nodiscard]] string text(const Token& token) const {
+        return program.source->value(token);
+    }
+
+    [[nodiscard]] uint64_t integerValue(const Token& token) const {
+
+        optional<uint64_t> value = program.source->integer(token);
+
+        if (!value) {
+            Location location = program.source->locate(token);
+            raise("Integer '" + text(token) + "' doesn't fit in 64 bits at " + to_string(location.line) + ":" + to_string(location.column));
+        }
+
+        return *value;
+
+    }
+
+    [[noreturn]] static void raise(const string& message) {
+        cerr << message << "!" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    const Node::Program program;
+    Module module;
+};
@@ -1,303 +1,1636 @@
-#pragma once
-
-#include <map>
-#include <cassert>
-#include <algorithm>
-#include "parser.h"
-
-class Generator {
-
-public:
-    inline explicit Generator(Node::Program program):
-            program(program)
-    {}
-
-    [[nodiscard]] string generate () {
-
-        assembly << "global _start\n"
-                 << "_start:\n";
-
-        generateScope(program.scope);
-
-        assembly << "    mov rax, 60" << endl
-                 << "    mov rdi, 0" << endl
-                 << "    syscall";
-
-        return assembly.str();
-
-    }
-
-private:
-
-    void generateScope(const Node::Scope* scope) {
-        for (const Node::Statement* statement : scope->statements) {
-            generateStatement(statement);
-        }
-    }
-
-    void generateStatement(const Node::Statement* statement) {
-
-        struct statementVisitor {
-
-            Generator* generator;
-
-            void operator()(const Node::StatementVariant::Exit* returnStatement) const {
-
-                generator->generateExpression(returnStatement->expression);
-
-                generator->assembly << "    mov rax, 60" << endl;
-                generator->pop("rdi");
-                generator->assembly << "    syscall" << endl;
-
-            }
-
-            void operator()(const Node::StatementVariant::Let* letStatement) const {
-
-                auto it = find_if(
-                    generator->variables.cbegin(),
-                    generator->variables.cend(),
-                    [&](const Variable& variable){
-                        return variable.name == letStatement->identifierToken.value.value();
-                    }
-                );
-
-                if (it != generator->variables.cend()) {
-                    cerr << "Double Declaration of Variable '" << letStatement->identifierToken.value.value() << "'!" << endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                generator->variables.push_back({ .name = letStatement->identifierToken.value.value(), .location = generator->stack_size });
-                generator->generateExpression(letStatement->expression);
-
-            }
-
-            void operator()(const Node::StatementVariant::Assign* assignStatement) const {
-
-                auto variable = find_if(
-                    generator->variables.cbegin(),
-                    generator->variables.cend(),
-                    [&](const Variable& variable){
-                        return variable.name == assignStatement->identifierToken.value.value();
-                    }
-                );
-
-                if (variable == generator->variables.cend()) {
-                    cerr << "Undeclared identifier: '" << assignStatement->identifierToken.value.value() << "'!" << endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                generator->generateExpression(assignStatement->expression);
-                generator->pop("rax");
-                generator->assembly << "    mov [rsp+" << (generator->stack_size - variable->location - 1) * 8 << "], rax" << endl;
-
-            }
-
-            void operator()(const Node::StatementVariant::If* ifStatement) const {
-
-                generator->generateExpression(ifStatement->condition);
-                generator->pop("rax");
-
-                bool hasElse = ifStatement->elseStatement.has_value();
-
-                string endLabel = generator->createLabel();
-                string elseLabel;
-
-                generator->assembly << "    test rax, rax" << endl;
-
-                if (hasElse) {
-                    elseLabel = generator->createLabel();
-                    generator->assembly << "    jz " << elseLabel << endl;
-                } else {
-                    generator->assembly << "    jz " << endLabel << endl;
-                }
-
-                generator->generateStatement(ifStatement->statement);
-
-                if (hasElse) {
-                    generator->assembly << "    jmp " << endLabel << endl
-                                        << elseLabel << ":" << endl;
-                    generator->generateStatement(ifStatement->elseStatement.value());
-                }
-
-                generator->assembly << endLabel << ":" << endl;
-
-            }
-
-            void operator()(const Node::Scope* scope) const {
-                generator->startScope();
-                generator->generateScope(scope);
-                generator->endScope();
-            }
-
-        };
-
-        statementVisitor visitor { .generator = this };
-        visit(visitor, statement->variant);
-
-    }
-
-    void generateExpression(const Node::Expression* expression) {
-
-        struct expressionVisitor {
-
-            Generator* generator;
-
-            void operator()(const Node::ExpressionVariant::Integer* integerExpression) const {
-
-                generator->assembly << "    mov rax, " << integerExpression->value.value.value() << endl;
-                generator->push("rax");
-
-            }
-
-            void operator()(const Node::ExpressionVariant::Identifier* identifierExpression) const {
-
-
-                auto it = find_if(
-                    generator->variables.cbegin(),
-                    generator->variables.cend(),
-                    [&](const Variable& variable){
-                        return variable.name == identifierExpression->value.value.value();
-                    }
-                );
-
-                if (it == generator->variables.cend()) {
-                    cerr << "Undeclared Variable '" << identifierExpression->value.value.value() << "'!" << endl;
-                    exit(EXIT_FAILURE);
-                }
-
-                generator->push("QWORD [rsp+" + to_string((generator->stack_size - (*it).location - 1) * 8) + "]");
-
-            }
-
-            void operator()(const Node::ExpressionVariant::RoundBrackets* roundBracketExpression) const {
-
-                generator->generateExpression(roundBracketExpression->expression);
-
-            }
-
-            void operator()(const Node::ExpressionVariant::Term* thermExpression) const {
-
-                generator->generateTerm(thermExpression);
-
-            }
-
-        };
-
-        expressionVisitor visitor { .generator = this };
-        visit(visitor, expression->variant);
-
-    };
-
-    void generateTerm(const Node::ExpressionVariant::Term* term) {
-
-        struct termVisitor {
-
-            Generator* generator;
-
-            void operator()(const Node::ExpressionVariant::TermVariant::Addition* additionTerm) const {
-
-                generator->generateExpression(additionTerm->left);
-                generator->generateExpression(additionTerm->right);
-
-                generator->pop("rbx");
-                generator->pop("rax");
-
-                generator->assembly << "    add rax, rbx" << endl;
-
-                generator->push("rax");
-
-            }
-
-            void operator()(const Node::ExpressionVariant::TermVariant::Subtraction* subtractionTerm) const {
-
-                generator->generateExpression(subtractionTerm->left);
-                generator->generateExpression(subtractionTerm->right);
-
-                generator->pop("rbx");
-                generator->pop("rax");
-
-                generator->assembly << "    sub rax, rbx" << endl;
-
-                generator->push("rax");
-
-            }
-
-            void operator()(const Node::ExpressionVariant::TermVariant::Multiplication* multiplicationTerm) const {
-
-                generator->generateExpression(multiplicationTerm->left);
-                generator->generateExpression(multiplicationTerm->right);
-
-                generator->pop("rbx");
-                generator->pop("rax");
-
-                generator->assembly << "    mul rbx" << endl;
-
-                generator->push("rax");
-
-            }
-
-            void operator()(const Node::ExpressionVariant::TermVariant::Division* divisionTerm) const {
-
-                generator->generateExpression(divisionTerm->left);
-                generator->generateExpression(divisionTerm->right);
-
-                generator->pop("rbx");
-                generator->pop("rax");
-
-                generator->assembly << "    div rbx" << endl;
-
-                generator->push("rax");
-
-            }
-
-        };
-
-        termVisitor visitor { .generator = this };
-        visit(visitor, term->variant);
-
-    }
-
-    // Scopes
-    void startScope() {
-        scopes.push_back(variables.size());
-    }
-
-    void endScope() {
-        size_t popCount = variables.size() - scopes.back();
-        assembly << "    add rsp, " << popCount * 8 << endl;
-        stack_size -= popCount;
-        for (int i = 0; i < popCount; i++) {
-            variables.pop_back();
-        }
-        scopes.pop_back();
-    }
-
-    vector<size_t> scopes {};
-
-    // Stack
-    size_t stack_size = 0;
-    void push (const string& reg) {
-        assembly << "    push " << reg << endl;
-        stack_size++;
-    }
-    void pop (const string& reg) {
-        assembly << "    pop " << reg << endl;
-        stack_size--;
-    }
-
-    // Variables
-    struct Variable {
-        string name;
-        size_t location;
-    };
-    vector<Variable> variables {};
-
-    // Labels
-    string createLabel () {
-        return "label" + to_string(++labelCount);
-    }
-    size_t labelCount = 0;
-
-    const Node::Program program; // Input
-    stringstream assembly; // Output
+#pragma once
+
+#include <map>
+#include <unordered_set>
+#include <deque>
+#include <cassert>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <array>
+#include <fstream>
+#include "parser.h"
+#include "superoptimizer.h"
+
+// Instruction set used for vectorized lets
+enum class Isa {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+// Profile guided layout of ifs: GENERATE counts how often every branch runs, USE lays the ifs out accordingly
+enum class Profiling {
+    NONE,
+    GENERATE,
+    USE
+};
+
+class Generator {
+
+public:
+    // With a `lineInfoSource`, statements are marked with %line directives, which NASM turns into DWARF line
+    // information when assembling with -g -F dwarf
+    inline explicit Generator(Node::Program program, Isa isa = Isa::SCALAR, size_t jobs = 1, string lineInfoSource = "",
+                              Profiling profiling = Profiling::NONE, string profilePath = "", const Superoptimizer* superoptimizer = nullptr):
+            program(program),
+            isa(isa),
+            jobs(jobs),
+            lineInfoSource(std::move(lineInfoSource)),
+            profiling(profiling),
+            profilePath(std::move(profilePath)),
+            superoptimizer(superoptimizer),
+            functions(functionTable)
+    {}
+
+    [[nodiscard]] string generate () {
+
+        collectFunctions();
+
+        if (profiling != Profiling::NONE) numberBranches();
+        if (profiling == Profiling::USE) loadProfile();
+
+        assembly << "global _start\n"
+                 << "_start:\n";
+
+        if (jobs > 1) generateParallel(program.scope);
+        else generateScope(program.scope);
+
+        if (profiling == Profiling::GENERATE) {
+            assembly << "    mov rdi, 0" << endl
+                     << "    jmp " << profileExitLabel;
+        } else {
+            assembly << "    mov rax, 60" << endl
+                     << "    mov rdi, 0" << endl
+                     << "    syscall";
+        }
+
+        for (const Function& function : functions) {
+            generateFunction(function);
+        }
+
+        if (profiling == Profiling::GENERATE) generateProfileExit();
+
+        if (!coldAssembly.str().empty()) {
+            assembly << endl << "section .text.unlikely progbits alloc exec nowrite align=16" << endl
+                     << coldAssembly.str();
+        }
+
+        return assembly.str();
+
+    }
+
+    // Streaming: the program arrives in pieces of complete top level statements and every piece is returned as soon
+    // as it is generated. Later statements can't be seen yet, so functions are placed right after the piece that
+    // defines them, behind a jump, and are never inlined.
+
+    [[nodiscard]] string generatePrologue() {
+        streaming = true;
+        return "global _start\n_start:\n";
+    }
+
+    [[nodiscard]] string generatePiece(Node::Program piece) {
+
+        program = piece;
+
+        collectFunctions();
+        generateScope(program.scope);
+
+        vector<Function*> defined;
+        for (const Node::Statement* statement : program.scope->statements) {
+            if (auto definition = get_if<Node::StatementVariant::Function*>(&statement->variant)) {
+                defined.push_back(&*find_if(functionTable.begin(), functionTable.end(), [&](const Function& function){ return function.definition == *definition; }));
+            }
+        }
+
+        if (!defined.empty()) {
+
+            string skipLabel = createLabel();
+            assembly << "    jmp " << skipLabel << endl;
+
+            // The functions get frames of their own, the top level variables continue after them
+            vector<Variable> savedVariables = std::move(variables);
+            size_t savedStackSize = stack_size;
+
+            for (const Function* function : defined) generateFunction(*function);
+
+            variables = std::move(savedVariables);
+            stack_size = savedStackSize;
+            scopes.clear();
+
+            assembly << endl << skipLabel << ":" << endl;
+
+        }
+
+        // The piece is freed after this, only the signatures of its functions are kept
+        for (Function* function : defined) function->definition = nullptr;
+
+        string code = assembly.str();
+        assembly.str("");
+        return code;
+
+    }
+
+    [[nodiscard]] string generateEpilogue() {
+
+        for (const Function& function : functions) {
+            if (function.forward) {
+                fail("Undeclared Function '" + function.name + "'");
+            }
+        }
+
+        assembly << "    mov rax, 60" << endl
+                 << "    mov rdi, 0" << endl
+                 << "    syscall";
+
+        string code = assembly.str();
+        assembly.str("");
+        return code;
+
+    }
+
+private:
+
+    void generateScope(const Node::Scope* scope) {
+        generateWork({ .step = Work::Step::SCOPE_STATEMENTS, .scope = scope });
+    }
+
+    // Generates the statement at `start`, or the run of lets starting there if it can be vectorized,
+    // and returns the number of statements consumed
+    size_t generateStatements(const vector<Node::Statement*>& statements, size_t start) {
+
+        if (isVectorizable(statements, start)) {
+            generateVectorLets(statements, start);
+            return vectorLanes();
+        }
+
+        generateStatement(statements[start]);
+        return 1;
+
+    }
+
+    void generateStatement(const Node::Statement* statement) {
+        generateWork({ .step = Work::Step::STATEMENT, .statement = statement });
+    }
+
+    // Nested statements are generated from an explicit work stack, so scopes and else if chains can nest arbitrarily deep.
+    // Code between BEGIN_COLD and END_COLD goes out of line, code between BEGIN_CAPTURE and END_CAPTURE is held back
+    // until EMIT_CAPTURED, which lets branches be placed in a different order than they are generated in.
+    struct Work {
+        enum class Step { STATEMENT, SCOPE_STATEMENTS, TEXT, END_SCOPE, BEGIN_COLD, END_COLD, BEGIN_CAPTURE, END_CAPTURE, EMIT_CAPTURED } step;
+        const Node::Statement* statement = nullptr; // STATEMENT
+        const Node::Scope* scope = nullptr;         // SCOPE_STATEMENTS, starting at `index`
+        size_t index = 0;
+        string text {};                             // TEXT
+    };
+
+    void generateWork(Work root) {
+
+        vector<Work> work;
+        work.push_back(std::move(root));
+
+        while (!work.empty()) {
+
+            Work item = std::move(work.back());
+            work.pop_back();
+
+            switch (item.step) {
+
+                case Work::Step::STATEMENT: {
+                    markLine(item.statement);
+                    statementVisitor visitor { .generator = this, .work = work };
+                    visit(visitor, item.statement->variant);
+                    break;
+                }
+
+                case Work::Step::SCOPE_STATEMENTS: {
+
+                    const vector<Node::Statement*>& statements = item.scope->statements;
+                    if (item.index == statements.size()) break;
+
+                    if (isVectorizable(statements, item.index)) {
+                        generateVectorLets(statements, item.index);
+                        work.push_back({ .step = Work::Step::SCOPE_STATEMENTS, .scope = item.scope, .index = item.index + vectorLanes() });
+                        break;
+                    }
+
+                    work.push_back({ .step = Work::Step::SCOPE_STATEMENTS, .scope = item.scope, .index = item.index + 1 });
+                    work.push_back({ .step = Work::Step::STATEMENT, .statement = statements[item.index] });
+
+                    break;
+
+                }
+
+                case Work::Step::TEXT: {
+                    assembly << item.text;
+                    break;
+                }
+
+                case Work::Step::END_SCOPE: {
+                    endScope();
+                    break;
+                }
+
+                case Work::Step::BEGIN_COLD: {
+                    if (coldDepth++ == 0) swap(assembly, coldAssembly);
+                    break;
+                }
+
+                case Work::Step::END_COLD: {
+                    if (--coldDepth == 0) swap(assembly, coldAssembly);
+                    break;
+                }
+
+                case Work::Step::BEGIN_CAPTURE: {
+                    captures.emplace_back();
+                    swap(assembly, captures.back());
+                    break;
+                }
+
+                case Work::Step::END_CAPTURE: {
+                    swap(assembly, captures.back());
+                    captured.push_back(captures.back().str());
+                    captures.pop_back();
+                    break;
+                }
+
+                case Work::Step::EMIT_CAPTURED: {
+                    assembly << captured.back();
+                    captured.pop_back();
+                    break;
+                }
+
+            }
+
+        }
+
+    }
+
+    struct statementVisitor {
+
+        Generator* generator;
+        vector<Work>& work;
+
+        void operator()(const Node::StatementVariant::Exit* returnStatement) const {
+
+            generator->generateExpression(returnStatement->expression);
+
+            // The counters are written before the process ends
+            if (generator->profiling == Profiling::GENERATE) {
+                generator->pop("rdi");
+                generator->assembly << "    jmp " << profileExitLabel << endl;
+                return;
+            }
+
+            generator->assembly << "    mov rax, 60" << endl;
+            generator->pop("rdi");
+            generator->assembly << "    syscall" << endl;
+
+        }
+
+        void operator()(const Node::StatementVariant::Let* letStatement) const {
+
+            auto it = find_if(
+                generator->variables.cbegin(),
+                generator->variables.cend(),
+                [&](const Variable& variable){
+                    return variable.name == generator->text(letStatement->identifierToken);
+                }
+            );
+
+            if (it != generator->variables.cend()) {
+                generator->fail("Double Declaration of Variable '" + string(generator->text(letStatement->identifierToken)) + "'");
+            }
+
+            generator->variables.push_back({ .name = string(generator->text(letStatement->identifierToken)), .location = generator->stack_size });
+
+            // The Optimizer drops initial values that are overwritten before being read, only reserve the slot
+            if (!letStatement->expression) {
+                generator->assembly << "    sub rsp, 8" << endl;
+                generator->stack_size++;
+                return;
+            }
+
+            generator->generateExpression(letStatement->expression);
+
+        }
+
+        void operator()(const Node::StatementVariant::Assign* assignStatement) const {
+
+            auto variable = find_if(
+                generator->variables.cbegin(),
+                generator->variables.cend(),
+                [&](const Variable& variable){
+                    return variable.name == generator->text(assignStatement->identifierToken);
+                }
+            );
+
+            if (variable == generator->variables.cend()) {
+                generator->fail("Undeclared identifier: '" + string(generator->text(assignStatement->identifierToken)) + "'");
+            }
+
+            generator->generateExpression(assignStatement->expression);
+            generator->pop("rax");
+            generator->assembly << "    mov [rsp+" << (generator->stack_size - variable->location - 1) * 8 << "], rax" << endl;
+
+        }
+
+        void operator()(const Node::StatementVariant::If* ifStatement) const {
+
+            generator->generateExpression(ifStatement->condition);
+            generator->pop("rax");
+
+            bool hasElse = ifStatement->elseStatement.has_value();
+
+            if (generator->profiling == Profiling::GENERATE) {
+                generator->assembly << "    inc qword [rel " << profileCountersLabel << " + " << generator->branchIndex(ifStatement) * 16 << "]" << endl;
+            }
+
+            // Branch label is the else label, or the then label if the then branch isn't the fall through
+            string endLabel = generator->createLabel();
+            string branchLabel;
+            if (hasElse || generator->profiling == Profiling::USE) branchLabel = generator->createLabel();
+
+            Work thenBranch { .step = Work::Step::STATEMENT, .statement = ifStatement->statement };
+            Work elseBranch { .step = Work::Step::STATEMENT, .statement = hasElse ? ifStatement->elseStatement.value() : nullptr };
+
+            auto text = [](string text) { return Work { .step = Work::Step::TEXT, .text = std::move(text) }; };
+            auto step = [](Work::Step step) { return Work { .step = step }; };
+
+            string jumpToEnd = "    jmp " + endLabel + "\n";
+
+            generator->assembly << "    test rax, rax" << endl;
+
+            switch (generator->branchLayout(ifStatement)) {
+
+                case BranchLayout::FALL_THROUGH: {
+
+                    generator->assembly << "    jz " << (hasElse ? branchLabel : endLabel) << endl;
+
+                    if (generator->profiling == Profiling::GENERATE) {
+                        generator->assembly << "    inc qword [rel " << profileCountersLabel << " + " << generator->branchIndex(ifStatement) * 16 + 8 << "]" << endl;
+                    }
+
+                    if (hasElse) schedule({ thenBranch, text(jumpToEnd + branchLabel + ":\n"), elseBranch, text(endLabel + ":\n") });
+                    else schedule({ thenBranch, text(endLabel + ":\n") });
+
+                    break;
+
+                }
+
+                case BranchLayout::COLD_ELSE: {
+                    generator->assembly << "    jz " << branchLabel << endl;
+                    schedule({ thenBranch, step(Work::Step::BEGIN_COLD), text(branchLabel + ":\n"), elseBranch, text(jumpToEnd), step(Work::Step::END_COLD), text(endLabel + ":\n") });
+                    break;
+                }
+
+                case BranchLayout::COLD_THEN: {
+
+                    generator->assembly << "    jnz " << branchLabel << endl;
+
+                    vector<Work> sequence { step(Work::Step::BEGIN_COLD), text(branchLabel + ":\n"), thenBranch, text(jumpToEnd), step(Work::Step::END_COLD) };
+                    if (hasElse) sequence.push_back(elseBranch);
+                    sequence.push_back(text(endLabel + ":\n"));
+
+                    schedule(std::move(sequence));
+
+                    break;
+
+                }
+
+                case BranchLayout::INVERTED: {
+                    // The then branch is still generated first, since a let in a branch declares into the enclosing scope
+                    generator->assembly << "    jnz " << branchLabel << endl;
+                    schedule({ step(Work::Step::BEGIN_CAPTURE), thenBranch, step(Work::Step::END_CAPTURE), elseBranch,
+                               text(jumpToEnd + branchLabel + ":\n"), step(Work::Step::EMIT_CAPTURED), text(endLabel + ":\n") });
+                    break;
+                }
+
+            }
+
+        }
+
+        // Queues the steps so they run in the given order
+        void schedule(vector<Work> sequence) const {
+            for (size_t i = sequence.size(); i > 0; i--) work.push_back(std::move(sequence[i - 1]));
+        }
+
+        void operator()(const Node::StatementVariant::Function* functionStatement) const {
+
+            // Function bodies are emitted after the program, see generateFunction
+            bool isTopLevel = any_of(
+                generator->functions.cbegin(),
+                generator->functions.cend(),
+                [&](const Function& function){
+                    return function.definition == functionStatement;
+                }
+            );
+
+            if (!isTopLevel) {
+                generator->fail("Function '" + string(generator->text(functionStatement->identifierToken)) + "' must be defined at top level");
+            }
+
+        }
+
+        void operator()(const Node::StatementVariant::Return* returnStatement) const {
+
+            if (!generator->currentFunction) {
+                generator->fail("Return outside of function");
+            }
+
+            // Self recursive tail call: reuse the current frame and jump back to the entry
+            auto call = asCall(returnStatement->expression);
+            if (call && &generator->findFunction(call) == generator->currentFunction) {
+
+                generator->generateArguments(call);
+
+                generator->assembly << "    add rsp, " << generator->stack_size * 8 << endl
+                                    << "    jmp " << functionLabel(generator->currentFunction->name) << endl;
+
+                return;
+
+            }
+
+            generator->generateExpression(returnStatement->expression);
+            generator->pop("rax");
+
+            generator->assembly << "    add rsp, " << generator->stack_size * 8 << endl
+                                << "    ret" << endl;
+
+        }
+
+        void operator()(const Node::Scope* scope) const {
+            generator->startScope();
+            work.push_back({ .step = Work::Step::END_SCOPE });
+            work.push_back({ .step = Work::Step::SCOPE_STATEMENTS, .scope = scope });
+        }
+
+    };
+
+    struct Function;
+
+    // Subexpressions are evaluated from an explicit stack as well, operations are emitted once their operands are pushed
+    struct PendingExpression {
+        enum class Step { EVALUATE, TERM, CALL, INLINE, END_INLINE } step;
+        const Node::Expression* expression = nullptr;               // EVALUATE
+        const Node::ExpressionVariant::Term* term = nullptr;        // TERM
+        const Node::ExpressionVariant::Call* call = nullptr;        // CALL, INLINE and END_INLINE
+        const Function* function = nullptr;
+    };
+
+    void generateExpression(const Node::Expression* expression) {
+
+        vector<PendingExpression> pending { { .step = PendingExpression::Step::EVALUATE, .expression = expression } };
+
+        while (!pending.empty()) {
+
+            PendingExpression item = pending.back();
+            pending.pop_back();
+
+            switch (item.step) {
+
+                case PendingExpression::Step::EVALUATE: {
+                    if (superoptimizer && generateSuperoptimized(item.expression)) break;
+                    expressionVisitor visitor { .generator = this, .pending = pending };
+                    visit(visitor, item.expression->variant);
+                    break;
+                }
+
+                case PendingExpression::Step::TERM: {
+                    generateTerm(item.term);
+                    break;
+                }
+
+                case PendingExpression::Step::CALL: {
+                    popArguments(item.call);
+                    assembly << "    call " << functionLabel(item.function->name) << endl;
+                    push("rax");
+                    break;
+                }
+
+                case PendingExpression::Step::INLINE: {
+                    pending.push_back({ .step = PendingExpression::Step::END_INLINE, .call = item.call, .function = item.function });
+                    pending.push_back({ .step = PendingExpression::Step::EVALUATE, .expression = inlineBody(*item.function) });
+                    break;
+                }
+
+                case PendingExpression::Step::END_INLINE: {
+                    endInline(*item.function);
+                    break;
+                }
+
+            }
+
+        }
+
+    }
+
+    struct expressionVisitor {
+
+        Generator* generator;
+        vector<PendingExpression>& pending;
+
+        void operator()(const Node::ExpressionVariant::Integer* integerExpression) const {
+
+            generator->assembly << "    mov rax, " << generator->text(integerExpression->value) << endl;
+            generator->push("rax");
+
+        }
+
+        void operator()(const Node::ExpressionVariant::Identifier* identifierExpression) const {
+
+
+            auto it = find_if(
+                generator->variables.cbegin(),
+                generator->variables.cend(),
+                [&](const Variable& variable){
+                    return variable.name == generator->text(identifierExpression->value);
+                }
+            );
+
+            if (it == generator->variables.cend()) {
+                generator->fail("Undeclared Variable '" + string(generator->text(identifierExpression->value)) + "'");
+            }
+
+            generator->push("QWORD [rsp+" + to_string((generator->stack_size - (*it).location - 1) * 8) + "]");
+
+        }
+
+        void operator()(const Node::ExpressionVariant::RoundBrackets* roundBracketExpression) const {
+
+            pending.push_back({ .step = PendingExpression::Step::EVALUATE, .expression = roundBracketExpression->expression });
+
+        }
+
+        void operator()(const Node::ExpressionVariant::Term* thermExpression) const {
+
+            pending.push_back({ .step = PendingExpression::Step::TERM, .term = thermExpression });
+
+            visit([&](auto* binary) {
+                pending.push_back({ .step = PendingExpression::Step::EVALUATE, .expression = binary->right });
+                pending.push_back({ .step = PendingExpression::Step::EVALUATE, .expression = binary->left });
+            }, thermExpression->variant);
+
+        }
+
+        void operator()(const Node::ExpressionVariant::Call* callExpression) const {
+
+            const Function& function = generator->findFunction(callExpression);
+
+            // The evaluated arguments stay on the stack and serve as the parameters of an inlined body
+            auto step = function.inlinable ? PendingExpression::Step::INLINE : PendingExpression::Step::CALL;
+            pending.push_back({ .step = step, .call = callExpression, .function = &function });
+
+            for (size_t i = callExpression->arguments.size(); i > 0; i--) {
+                pending.push_back({ .step = PendingExpression::Step::EVALUATE, .expression = callExpression->arguments[i - 1] });
+            }
+
+        }
+
+    };
+
+    // Emits the operation once both operands are on the stack
+    void generateTerm(const Node::ExpressionVariant::Term* term) {
+
+        struct termVisitor {
+
+            Generator* generator;
+
+            void operator()(const Node::ExpressionVariant::TermVariant::Addition*) const {
+                generator->pop("rbx");
+                generator->pop("rax");
+                generator->assembly << "    add rax, rbx" << endl;
+                generator->push("rax");
+            }
+
+            void operator()(const Node::ExpressionVariant::TermVariant::Subtraction*) const {
+                generator->pop("rbx");
+                generator->pop("rax");
+                generator->assembly << "    sub rax, rbx" << endl;
+                generator->push("rax");
+            }
+
+            void operator()(const Node::ExpressionVariant::TermVariant::Multiplication*) const {
+                generator->pop("rbx");
+                generator->pop("rax");
+                generator->assembly << "    mul rbx" << endl;
+                generator->push("rax");
+            }
+
+            void operator()(const Node::ExpressionVariant::TermVariant::Division*) const {
+                generator->pop("rbx");
+                generator->pop("rax");
+                generator->assembly << "    div rbx" << endl;
+                generator->push("rax");
+            }
+
+        };
+
+        termVisitor visitor { .generator = this };
+        visit(visitor, term->variant);
+
+    }
+
+    // Superoptimization
+    // Terms with a sequence in the table load their variables straight from their slots and run the sequence
+
+    bool generateSuperoptimized(const Node::Expression* expression) {
+
+        optional<Superoptimizer::Shape> shape = Superoptimizer::shape(expression, *program.source);
+        if (!shape) return false;
+
+        const vector<string>* instructions = superoptimizer->lookup(shape->key);
+        if (!instructions) return false;
+
+        // Undeclared variables are reported by the regular path
+        vector<size_t> offsets;
+        for (const string& name : shape->variables) {
+            auto variable = findVariable(name);
+            if (variable == variables.cend()) return false;
+            offsets.push_back((stack_size - variable->location - 1) * 8);
+        }
+
+        for (size_t i = 0; i < offsets.size(); i++) {
+            assembly << "    mov " << Superoptimizer::inputRegisters[i] << ", [rsp+" << offsets[i] << "]" << endl;
+        }
+
+        for (const string& instruction : *instructions) assembly << "    " << instruction << endl;
+
+        push("rax");
+        return true;
+
+    }
+
+    // Functions
+    struct Function {
+        string name;
+        const Node::StatementVariant::Function* definition;
+        size_t parameters = 0;
+        bool recursive = false;
+        bool inlinable = false;
+        bool forward = false;   // Called before its definition was seen, only while streaming
+    };
+    deque<Function> functionTable {};  // Calls refer to their functions while new ones are added
+    bool streaming = false;
+    const Function* currentFunction = nullptr;
+
+    // System V integer argument registers, in parameter order
+    static constexpr const char* argumentRegisters[] = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+    // Functions consisting of a single return whose expression has at most this many nodes get inlined
+    static constexpr size_t inlineThreshold = 16;
+
+    static string functionLabel(const string& name) {
+        return "fn_" + name;
+    }
+
+    void collectFunctions() {
+
+        for (const Node::Statement* statement : program.scope->statements) {
+
+            auto definition = get_if<Node::StatementVariant::Function*>(&statement->variant);
+            if (!definition) continue;
+
+            string_view name = text((*definition)->identifierToken);
+            size_t parameters = (*definition)->parameters.size();
+
+            auto existing = find_if(functionTable.begin(), functionTable.end(), [&](const Function& function){ return function.name == name; });
+
+            if (existing != functionTable.end() && !existing->forward) {
+                fail("Double Declaration of Function '" + string(name) + "'");
+            }
+
+            if (parameters > size(argumentRegisters)) {
+                fail("Function '" + string(name) + "' has more than " + to_string(size(argumentRegisters)) + " parameters");
+            }
+
+            // Calls in earlier pieces already fixed the number of arguments
+            if (existing != functionTable.end()) {
+
+                if (existing->parameters != parameters) {
+                    fail("Function '" + string(name) + "' expects " + to_string(parameters) + " arguments but got " + to_string(existing->parameters));
+                }
+
+                existing->definition = *definition;
+                existing->forward = false;
+                continue;
+
+            }
+
+            functionTable.push_back({ .name = string(name), .definition = *definition, .parameters = parameters });
+
+        }
+
+        // The bodies of earlier pieces are gone, so the call graph isn't known
+        if (streaming) return;
+
+        for (Function& function : functionTable) {
+
+            // A function is recursive if it can reach itself through the call graph
+            vector<string_view> pending;
+            vector<string_view> visited;
+            collectCalls(function.definition->scope, pending);
+
+            while (!pending.empty() && !function.recursive) {
+
+                string_view name = pending.back();
+                pending.pop_back();
+
+                if (name == function.name) function.recursive = true;
+                if (find(visited.cbegin(), visited.cend(), name) != visited.cend()) continue;
+                visited.push_back(name);
+
+                auto callee = find_if(functions.cbegin(), functions.cend(), [&](const Function& other){ return other.name == name; });
+                if (callee != functions.cend()) collectCalls(callee->definition->scope, pending);
+
+            }
+
+            const Node::Scope* body = function.definition->scope;
+
+            if (!function.recursive && body->statements.size() == 1) {
+                if (auto returnStatement = get_if<Node::StatementVariant::Return*>(&body->statements.front()->variant)) {
+                    function.inlinable = expressionSize((*returnStatement)->expression) <= inlineThreshold;
+                }
+            }
+
+        }
+
+    }
+
+    void generateFunction(const Function& function) {
+
+        currentFunction = &function;
+        variables.clear();
+        scopes.clear();
+        stack_size = 0;
+
+        assembly << endl << functionLabel(function.name) << ":" << endl;
+
+        // Spill the register arguments so parameters live on the stack like any other variable
+        const vector<Token>& parameters = function.definition->parameters;
+        for (size_t i = 0; i < parameters.size(); i++) {
+
+            string_view name = text(parameters[i]);
+
+            if (any_of(variables.cbegin(), variables.cend(), [&](const Variable& variable){ return variable.name == name; })) {
+                fail("Double Declaration of Parameter '" + string(name) + "'");
+            }
+
+            variables.push_back({ .name = string(name), .location = stack_size });
+            push(argumentRegisters[i]);
+
+        }
+
+        generateScope(function.definition->scope);
+
+        // Falling off the end of a function returns 0
+        assembly << "    mov rax, 0" << endl
+                 << "    add rsp, " << stack_size * 8 << endl
+                 << "    ret" << endl;
+
+        currentFunction = nullptr;
+
+    }
+
+    const Function& findFunction(const Node::ExpressionVariant::Call* call) {
+
+        string_view name = text(call->identifierToken);
+
+        auto function = find_if(functions.cbegin(), functions.cend(), [&](const Function& function){ return function.name == name; });
+
+        // While streaming the definition may still follow, the call decides the number of parameters until then
+        if (function == functions.cend() && streaming) {
+            functionTable.push_back({ .name = string(name), .definition = nullptr, .parameters = call->arguments.size(), .forward = true });
+            return functionTable.back();
+        }
+
+        if (function == functions.cend()) {
+            fail("Undeclared Function '" + string(name) + "'");
+        }
+
+        if (function->parameters != call->arguments.size()) {
+            fail("Function '" + string(name) + "' expects " + to_string(function->parameters) + " arguments but got " + to_string(call->arguments.size()));
+        }
+
+        return *function;
+
+    }
+
+    // Evaluates the arguments on the stack and moves them into the argument registers
+    void generateArguments(const Node::ExpressionVariant::Call* call) {
+
+        for (const Node::Expression* argument : call->arguments) {
+            generateExpression(argument);
+        }
+
+        popArguments(call);
+
+    }
+
+    void popArguments(const Node::ExpressionVariant::Call* call) {
+        for (size_t i = call->arguments.size(); i > 0; i--) {
+            pop(argumentRegisters[i - 1]);
+        }
+    }
+
+    // The evaluated arguments on top of the stack become the parameters of the body, returns the expression to evaluate
+    const Node::Expression* inlineBody(const Function& function) {
+
+        const vector<Token>& parameters = function.definition->parameters;
+
+        callerVariables.push_back(std::move(variables));
+        variables.clear();
+
+        for (size_t i = 0; i < parameters.size(); i++) {
+            variables.push_back({ .name = string(text(parameters[i])), .location = stack_size - parameters.size() + i });
+        }
+
+        return get<Node::StatementVariant::Return*>(function.definition->scope->statements.front()->variant)->expression;
+
+    }
+
+    void endInline(const Function& function) {
+
+        const vector<Token>& parameters = function.definition->parameters;
+
+        variables = std::move(callerVariables.back());
+        callerVariables.pop_back();
+
+        if (!parameters.empty()) {
+            pop("rax");
+            assembly << "    add rsp, " << parameters.size() * 8 << endl;
+            stack_size -= parameters.size();
+            push("rax");
+        }
+
+    }
+
+    static const Node::ExpressionVariant::Call* asCall(const Node::Expression* expression) {
+        while (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            expression = (*brackets)->expression;
+        }
+        auto call = get_if<Node::ExpressionVariant::Call*>(&expression->variant);
+        return call ? *call : nullptr;
+    }
+
+    static size_t expressionSize(const Node::Expression* expression) {
+
+        size_t size = 0;
+
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (!holds_alternative<Node::ExpressionVariant::RoundBrackets*>(subexpression->variant)) size++;
+        });
+
+        return size;
+
+    }
+
+    void collectCalls(const Node::Scope* scope, vector<string_view>& calls) {
+
+        for (const Node::Statement* statement : scope->statements) {
+            Node::forEachStatement(statement, [&](const Node::Statement* nested) {
+
+                const Node::Expression* expression = Node::evaluatedExpression(nested);
+                if (!expression) return;
+
+                Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+                    if (auto call = get_if<Node::ExpressionVariant::Call*>(&subexpression->variant)) calls.push_back(text((*call)->identifierToken));
+                });
+
+            });
+        }
+
+    }
+
+    // Vectorization
+    // Runs of independent lets with the same expression shape are computed lane by lane in one vector register.
+    // Lane i holds the let at position lanes - 1 - i, so storing the register below rsp lays them out like pushes.
+
+    [[nodiscard]] size_t vectorLanes() const {
+        switch (isa) {
+            case Isa::SSE2: return 2;
+            case Isa::AVX2: return 4;
+            default: return 0;
+        }
+    }
+
+    static constexpr size_t vectorShapeLimit = 64;
+
+    bool isVectorizable(const vector<Node::Statement*>& statements, size_t start) {
+
+        size_t lanes = vectorLanes();
+        if (lanes == 0 || start + lanes > statements.size()) return false;
+
+        vector<const Node::StatementVariant::Let*> lets;
+
+        for (size_t i = start; i < start + lanes; i++) {
+            auto letStatement = get_if<Node::StatementVariant::Let*>(&statements[i]->variant);
+            if (!letStatement || !(*letStatement)->expression) return false;
+            lets.push_back(*letStatement);
+        }
+
+        const Node::Expression* shape = lets.front()->expression;
+
+        // Larger shapes stay scalar, which also bounds the recursion of the shape checks below
+        if (expressionSize(shape) > vectorShapeLimit) return false;
+
+        // Plain constants and copies are cheaper as pushes, registers are limited to xmm0 - xmm15
+        if (isLeaf(unbracket(shape)) || !isVectorArithmetic(shape) || vectorRegisters(shape, 0) > 15) return false;
+
+        for (const Node::StatementVariant::Let* let : lets) {
+
+            if (!isomorphic(shape, let->expression)) return false;
+
+            string_view name = text(let->identifierToken);
+
+            // Declaration errors are reported by the scalar path
+            if (findVariable(name) != variables.cend()) return false;
+            if (count_if(lets.cbegin(), lets.cend(), [&](auto other){ return text(other->identifierToken) == name; }) > 1) return false;
+
+            // The lets have to be independent of each other
+            vector<const Node::Expression*> leaves;
+            collectLeaves(let->expression, leaves);
+
+            for (const Node::Expression* leaf : leaves) {
+
+                auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&leaf->variant);
+                if (!identifier) continue;
+
+                string_view operand = text((*identifier)->value);
+                if (findVariable(operand) == variables.cend()) return false;
+                if (any_of(lets.cbegin(), lets.cend(), [&](auto other){ return text(other->identifierToken) == operand; })) return false;
+
+            }
+
+        }
+
+        // Every operand has to load with a single instruction, gathering the lanes one by one costs more than the
+        // scalar code saves
+        vector<vector<const Node::Expression*>> leaves(lanes);
+        for (size_t i = 0; i < lanes; i++) collectLeaves(lets[lanes - 1 - i]->expression, leaves[i]);
+
+        for (size_t leaf = 0; leaf < leaves.front().size(); leaf++) {
+
+            vector<const Node::Expression*> operands;
+            for (const vector<const Node::Expression*>& lane : leaves) operands.push_back(lane[leaf]);
+
+            if (!isUniform(operands) && !isContiguous(operands)) return false;
+
+        }
+
+        return true;
+
+    }
+
+    void generateVectorLets(const vector<Node::Statement*>& statements, size_t start) {
+
+        markLine(statements[start]);
+
+        size_t lanes = vectorLanes();
+
+        vector<const Node::Expression*> expressions;
+        for (size_t i = lanes; i > 0; i--) {
+            expressions.push_back(get<Node::StatementVariant::Let*>(statements[start + i - 1]->variant)->expression);
+        }
+
+        generateVectorExpression(expressions, 0);
+
+        assembly << "    sub rsp, " << lanes * 8 << endl;
+
+        if (isa == Isa::AVX2) {
+            assembly << "    vmovdqu [rsp], ymm0" << endl
+                     << "    vzeroupper" << endl;
+        } else {
+            assembly << "    movdqu [rsp], xmm0" << endl;
+        }
+
+        for (size_t i = start; i < start + lanes; i++) {
+            variables.push_back({ .name = string(text(get<Node::StatementVariant::Let*>(statements[i]->variant)->identifierToken)), .location = stack_size });
+            stack_size++;
+        }
+
+    }
+
+    // Computes the lanes into vector register `target`, registers above it are free to use
+    void generateVectorExpression(vector<const Node::Expression*> lanes, int target) {
+
+        for (const Node::Expression*& lane : lanes) lane = unbracket(lane);
+
+        auto term = get_if<Node::ExpressionVariant::Term*>(&lanes.front()->variant);
+
+        if (!term) {
+            generateVectorLeaves(lanes, target);
+            return;
+        }
+
+        vector<const Node::Expression*> left, right;
+        for (const Node::Expression* lane : lanes) {
+            visit([&](auto* binary) {
+                left.push_back(binary->left);
+                right.push_back(binary->right);
+            }, get<Node::ExpressionVariant::Term*>(lane->variant)->variant);
+        }
+
+        generateVectorExpression(left, target);
+        generateVectorExpression(right, target + 1);
+
+        string a = vectorRegister(target), b = vectorRegister(target + 1);
+
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Addition*>((*term)->variant)) {
+            vectorInstruction("paddq", a, b);
+        }
+        else if (holds_alternative<Node::ExpressionVariant::TermVariant::Subtraction*>((*term)->variant)) {
+            vectorInstruction("psubq", a, b);
+        }
+        else {
+
+            // There is no packed 64 bit multiplication, compose it from 32 x 32 -> 64 bit products:
+            // a * b = lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32)
+            string t1 = vectorRegister(target + 2), t2 = vectorRegister(target + 3);
+
+            vectorShift("psrlq", t1, a, 32);
+            vectorInstruction("pmuludq", t1, b);
+            vectorShift("psrlq", t2, b, 32);
+            vectorInstruction("pmuludq", t2, a);
+            vectorInstruction("paddq", t1, t2);
+            vectorShift("psllq", t1, t1, 32);
+            vectorInstruction("pmuludq", a, b);
+            vectorInstruction("paddq", a, t1);
+
+        }
+
+    }
+
+    void generateVectorLeaves(const vector<const Node::Expression*>& lanes, int target) {
+
+        if (isUniform(lanes)) {
+            loadLane(lanes.front(), "xmm" + to_string(target));
+            if (isa == Isa::AVX2) assembly << "    vpbroadcastq ymm" << target << ", xmm" << target << endl;
+            else assembly << "    punpcklqdq xmm" << target << ", xmm" << target << endl;
+            return;
+        }
+
+        // The lanes are adjacent on the stack, lane 0 at the lowest address
+        auto variable = findVariable(text(get<Node::ExpressionVariant::Identifier*>(lanes.front()->variant)->value));
+        assembly << "    " << (isa == Isa::AVX2 ? "vmovdqu " : "movdqu ") << vectorRegister(target)
+                 << ", [rsp+" << (stack_size - variable->location - 1) * 8 << "]" << endl;
+
+    }
+
+    bool isUniform(const vector<const Node::Expression*>& lanes) {
+        return all_of(lanes.cbegin(), lanes.cend(), [&](const Node::Expression* lane){
+            return leafValue(lane) == leafValue(lanes.front());
+        });
+    }
+
+    // Whether the lanes are variables that lie next to each other on the stack in lane order
+    bool isContiguous(const vector<const Node::Expression*>& lanes) {
+
+        optional<size_t> first;
+
+        for (size_t i = 0; i < lanes.size(); i++) {
+
+            auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&lanes[i]->variant);
+            if (!identifier) return false;
+
+            auto variable = findVariable(text((*identifier)->value));
+            if (variable == variables.cend()) return false;
+
+            if (!first) first = variable->location;
+            else if (variable->location + i != *first) return false;
+
+        }
+
+        return true;
+
+    }
+
+    // AVX2 code stays VEX encoded throughout, mixing in legacy SSE instructions costs state transitions
+    void loadLane(const Node::Expression* leaf, const string& reg) {
+
+        string move = isa == Isa::AVX2 ? "vmovq " : "movq ";
+
+        if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&leaf->variant)) {
+            assembly << "    mov rax, " << text((*integer)->value) << endl
+                     << "    " << move << reg << ", rax" << endl;
+            return;
+        }
+
+        auto variable = findVariable(text(get<Node::ExpressionVariant::Identifier*>(leaf->variant)->value));
+        assembly << "    " << move << reg << ", [rsp+" << (stack_size - variable->location - 1) * 8 << "]" << endl;
+
+    }
+
+    [[nodiscard]] string vectorRegister(int index) const {
+        return (isa == Isa::AVX2 ? "ymm" : "xmm") + to_string(index);
+    }
+
+    void vectorInstruction(const string& instruction, const string& target, const string& source) {
+        if (isa == Isa::AVX2) assembly << "    v" << instruction << " " << target << ", " << target << ", " << source << endl;
+        else assembly << "    " << instruction << " " << target << ", " << source << endl;
+    }
+
+    void vectorShift(const string& instruction, const string& target, const string& source, int bits) {
+        if (isa == Isa::AVX2) {
+            assembly << "    v" << instruction << " " << target << ", " << source << ", " << bits << endl;
+            return;
+        }
+        if (target != source) assembly << "    movdqa " << target << ", " << source << endl;
+        assembly << "    " << instruction << " " << target << ", " << bits << endl;
+    }
+
+    static const Node::Expression* unbracket(const Node::Expression* expression) {
+        while (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            expression = (*brackets)->expression;
+        }
+        return expression;
+    }
+
+    static bool isLeaf(const Node::Expression* expression) {
+        return holds_alternative<Node::ExpressionVariant::Identifier*>(expression->variant)
+            || holds_alternative<Node::ExpressionVariant::Integer*>(expression->variant);
+    }
+
+    string leafValue(const Node::Expression* leaf) {
+        if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&leaf->variant)) return string(text((*integer)->value));
+        return "$" + string(text(get<Node::ExpressionVariant::Identifier*>(leaf->variant)->value));
+    }
+
+    // Only + - * over variables and integers have packed equivalents
+    static bool isVectorArithmetic(const Node::Expression* expression) {
+
+        expression = unbracket(expression);
+
+        if (isLeaf(expression)) return true;
+
+        auto term = get_if<Node::ExpressionVariant::Term*>(&expression->variant);
+        if (!term || holds_alternative<Node::ExpressionVariant::TermVariant::Division*>((*term)->variant)) return false;
+
+        return visit([](auto* binary) {
+            return isVectorArithmetic(binary->left) && isVectorArithmetic(binary->right);
+        }, (*term)->variant);
+
+    }
+
+    static bool isomorphic(const Node::Expression* a, const Node::Expression* b) {
+
+        a = unbracket(a);
+        b = unbracket(b);
+
+        if (isLeaf(a) || isLeaf(b)) return isLeaf(a) && isLeaf(b);
+
+        auto termA = get_if<Node::ExpressionVariant::Term*>(&a->variant);
+        auto termB = get_if<Node::ExpressionVariant::Term*>(&b->variant);
+        if (!termA || !termB || (*termA)->variant.index() != (*termB)->variant.index()) return false;
+
+        auto operands = [](const Node::ExpressionVariant::Term* term) {
+            return visit([](auto* binary) { return pair { binary->left, binary->right }; }, term->variant);
+        };
+
+        auto [leftA, rightA] = operands(*termA);
+        auto [leftB, rightB] = operands(*termB);
+
+        return isomorphic(leftA, leftB) && isomorphic(rightA, rightB);
+
+    }
+
+    // Highest vector register index used to compute the expression into register `target`
+    static int vectorRegisters(const Node::Expression* expression, int target) {
+
+        expression = unbracket(expression);
+
+        auto term = get_if<Node::ExpressionVariant::Term*>(&expression->variant);
+        if (!term) return target + 2;
+
+        int multiplication = holds_alternative<Node::ExpressionVariant::TermVariant::Multiplication*>((*term)->variant) ? target + 3 : 0;
+
+        return visit([&](auto* binary) {
+            return max({ vectorRegisters(binary->left, target), vectorRegisters(binary->right, target + 1), multiplication });
+        }, (*term)->variant);
+
+    }
+
+    static void collectLeaves(const Node::Expression* expression, vector<const Node::Expression*>& leaves) {
+
+        expression = unbracket(expression);
+
+        if (auto term = get_if<Node::ExpressionVariant::Term*>(&expression->variant)) {
+            visit([&](auto* binary) {
+                collectLeaves(binary->left, leaves);
+                collectLeaves(binary->right, leaves);
+            }, (*term)->variant);
+        }
+        else leaves.push_back(expression);
+
+    }
+
+    // Parallel Generation
+    // Top level scopes and ifs leave the variables and the stack as they found them, so they are generated by worker
+    // threads from a copy of the state at their entry. Of the variables only those the statement names are copied,
+    // the function table is shared. Their labels are reserved up front, which keeps the output identical to the
+    // sequential one.
+
+    struct Variable;
+
+    struct Task {
+        const Node::Statement* statement;
+        unique_ptr<Generator> generator;
+        size_t segment; // Index of the output segment the task fills
+        optional<string> error {};
+    };
+
+    inline Generator(const Generator& parent, const Node::Statement* statement, size_t labelCount):
+            program(parent.program),
+            isa(parent.isa),
+            jobs(1),
+            lineInfoSource(parent.lineInfoSource),
+            profiling(parent.profiling),
+            profilePath(parent.profilePath),
+            profile(parent.profile),
+            superoptimizer(parent.superoptimizer),
+            functions(parent.functions),
+            stack_size(parent.stack_size),
+            variables(parent.variablesNamedIn(statement)),
+            labelCount(labelCount)
+    {
+        collectErrors = true;
+    }
+
+    // The variables in scope that the statement reads, assigns or declares again, which is all of them it can reach
+    [[nodiscard]] vector<Variable> variablesNamedIn(const Node::Statement* statement) const {
+
+        unordered_set<string_view> names;
+
+        Node::forEachStatement(statement, [&](const Node::Statement* nested) {
+
+            if (auto letStatement = get_if<Node::StatementVariant::Let*>(&nested->variant)) names.insert(text((*letStatement)->identifierToken));
+            if (auto assignStatement = get_if<Node::StatementVariant::Assign*>(&nested->variant)) names.insert(text((*assignStatement)->identifierToken));
+
+            const Node::Expression* expression = Node::evaluatedExpression(nested);
+            if (!expression) return;
+
+            Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+                if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&subexpression->variant)) names.insert(text((*identifier)->value));
+            });
+
+        });
+
+        vector<Variable> named;
+        for (const Variable& variable : variables) {
+            if (names.contains(variable.name)) named.push_back(variable);
+        }
+        return named;
+
+    }
+
+    void generateParallel(const Node::Scope* scope) {
+
+        const vector<Node::Statement*>& statements = scope->statements;
+
+        // Out of line code is collected in segments of its own, in the same order
+        vector<string> segments;
+        vector<string> coldSegments;
+        vector<Task> tasks;
+
+        // An error here comes after all tasks created so far, their statements come first in the program
+        optional<string> error;
+        collectErrors = true;
+
+        for (size_t i = 0; i < statements.size();) {
+
+            const Node::Statement* statement = statements[i];
+
+            bool independent = holds_alternative<Node::Scope*>(statement->variant) || holds_alternative<Node::StatementVariant::If*>(statement->variant);
+
+            if (!independent || !keepsState(statement)) {
+                try {
+                    i += generateStatements(statements, i);
+                } catch (const GenerationError& generationError) {
+                    error = generationError.message;
+                    break;
+                }
+                continue;
+            }
+
+            segments.push_back(assembly.str());
+            assembly.str("");
+            coldSegments.push_back(coldAssembly.str());
+            coldAssembly.str("");
+
+            tasks.push_back({ .statement = statement, .generator = unique_ptr<Generator>(new Generator(*this, statement, labelCount)), .segment = segments.size() });
+            segments.emplace_back();
+            coldSegments.emplace_back();
+
+            labelCount += countLabels(statement);
+            i++;
+
+        }
+
+        segments.push_back(assembly.str());
+        assembly.str("");
+        coldSegments.push_back(coldAssembly.str());
+        coldAssembly.str("");
+
+        atomic<size_t> nextTask = 0;
+        vector<thread> workers;
+
+        // More workers than cores only add overhead, the tasks are the same however many there are
+        size_t workerCount = min({ jobs, tasks.size(), size_t(max(thread::hardware_concurrency(), 1u)) });
+
+        for (size_t worker = 0; worker < workerCount; worker++) {
+            workers.emplace_back([&]() {
+                for (size_t index = nextTask++; index < tasks.size(); index = nextTask++) {
+                    Task& task = tasks[index];
+                    try {
+                        task.generator->generateStatement(task.statement);
+                    } catch (const GenerationError& generationError) {
+                        task.error = generationError.message;
+                        continue;
+                    }
+                    segments[task.segment] = task.generator->assembly.str();
+                    coldSegments[task.segment] = task.generator->coldAssembly.str();
+                }
+            });
+        }
+
+        for (thread& worker : workers) worker.join();
+
+        collectErrors = false;
+
+        for (const Task& task : tasks) {
+            if (task.error) fail(task.error.value());
+        }
+        if (error) fail(error.value());
+
+        for (const string& segment : segments) assembly << segment;
+        for (const string& segment : coldSegments) coldAssembly << segment;
+
+    }
+
+    // Whether the variables and the stack are the same before and after the statement
+    static bool keepsState(const Node::Statement* statement) {
+
+        // Scopes clean up after themselves, only the branches of ifs need a closer look
+        vector<const Node::Statement*> pending { statement };
+
+        while (!pending.empty()) {
+
+            const Node::Statement* current = pending.back();
+            pending.pop_back();
+
+            if (holds_alternative<Node::StatementVariant::Let*>(current->variant)) return false;
+            if (holds_alternative<Node::StatementVariant::Function*>(current->variant)) return false;
+
+            if (auto ifStatement = get_if<Node::StatementVariant::If*>(&current->variant)) {
+                pending.push_back((*ifStatement)->statement);
+                if ((*ifStatement)->elseStatement.has_value()) pending.push_back((*ifStatement)->elseStatement.value());
+            }
+
+        }
+
+        return true;
+
+    }
+
+    // Number of labels generateStatement creates for the statement
+    [[nodiscard]] size_t countLabels(const Node::Statement* statement) const {
+
+        size_t count = 0;
+
+        Node::forEachStatement(statement, [&](const Node::Statement* nested) {
+            if (auto ifStatement = get_if<Node::StatementVariant::If*>(&nested->variant)) {
+                count += (*ifStatement)->elseStatement.has_value() || profiling == Profiling::USE ? 2 : 1;
+            }
+        });
+
+        return count;
+
+    }
+
+    // Configuration, declared in the order the constructors initialize it
+    struct BranchProfile; // Defined with the profile guided layout
+    Node::Program program; // Input, the current piece while streaming
+    const Isa isa;
+    const size_t jobs;
+    const string lineInfoSource;
+    const Profiling profiling;
+    const string profilePath;
+    shared_ptr<BranchProfile> profile;
+    const Superoptimizer* superoptimizer;
+    const deque<Function>& functions; // Read only, parallel tasks share the table of the Generator that created them
+
+    // Scopes
+    void startScope() {
+        scopes.push_back(variables.size());
+    }
+
+    void endScope() {
+        size_t popCount = variables.size() - scopes.back();
+        assembly << "    add rsp, " << popCount * 8 << endl;
+        stack_size -= popCount;
+        for (int i = 0; i < popCount; i++) {
+            variables.pop_back();
+        }
+        scopes.pop_back();
+    }
+
+    vector<size_t> scopes {};
+
+    // Stack
+    size_t stack_size = 0;
+    void push (const string& reg) {
+        assembly << "    push " << reg << endl;
+        stack_size++;
+    }
+    void pop (const string& reg) {
+        assembly << "    pop " << reg << endl;
+        stack_size--;
+    }
+
+    [[nodiscard]] string_view text(const Token& token) const {
+        return program.source->view(token);
+    }
+
+    // Errors end the compilation. Parallel generation collects them instead, so that the one the sequential
+    // generation would have reported is reported once all workers are done.
+    struct GenerationError {
+        string message;
+    };
+
+    bool collectErrors = false;
+
+    [[noreturn]] void fail(const string& message) const {
+        if (collectErrors) throw GenerationError { message };
+        cerr << message << "!" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // Variables
+    struct Variable {
+        string name;
+        size_t location;
+    };
+    vector<Variable> variables {};
+    vector<vector<Variable>> callerVariables {}; // Saved while an inlined body is generated
+
+    vector<Variable>::const_iterator findVariable(string_view name) const {
+        return find_if(variables.cbegin(), variables.cend(), [&](const Variable& variable){ return variable.name == name; });
+    }
+
+    // Profile Guided Layout
+    // Ifs are numbered in pre-order of the program followed by the function bodies, independent of the layout.
+    // The profile file holds the number of ifs followed by two counters for each of them: how often the if was
+    // executed and how often its then branch ran.
+
+    enum class BranchLayout {
+        FALL_THROUGH,   // then falls through, else behind a jump
+        COLD_ELSE,      // else out of line
+        COLD_THEN,      // inverted condition, then out of line
+        INVERTED        // inverted condition, else falls through and then follows behind a jump
+    };
+
+    struct BranchProfile {
+        map<const Node::StatementVariant::If*, size_t> indices;
+        vector<array<uint64_t, 2>> counts; // Only loaded when using a profile
+    };
+
+    // A branch that runs at most once per this many runs of the other one is moved out of line
+    static constexpr uint64_t coldRatio = 16;
+
+    static constexpr const char* profileExitLabel = "__profile_exit";
+    static constexpr const char* profileCountersLabel = "__profile_counters";
+
+    stringstream coldAssembly;      // Out of line code, emitted in a section of its own after everything else
+    size_t coldDepth = 0;
+    vector<stringstream> captures;  // Code held back by BEGIN_CAPTURE
+    vector<string> captured;
+
+    void numberBranches() {
+
+        profile = make_shared<BranchProfile>();
+
+        auto number = [&](const Node::Scope* scope) {
+            for (const Node::Statement* statement : scope->statements) {
+                Node::forEachStatement(statement, [&](const Node::Statement* nested) {
+                    if (auto ifStatement = get_if<Node::StatementVariant::If*>(&nested->variant)) {
+                        profile->indices.emplace(*ifStatement, profile->indices.size());
+                    }
+                });
+            }
+        };
+
+        number(program.scope);
+        for (const Function& function : functions) number(function.definition->scope);
+
+    }
+
+    [[nodiscard]] size_t branchIndex(const Node::StatementVariant::If* ifStatement) const {
+        return profile->indices.at(ifStatement);
+    }
+
+    // A profile that doesn't fit the program is ignored, the ifs are laid out as usual then
+    void loadProfile() {
+
+        ifstream file(profilePath, ios::in | ios::binary);
+
+        uint64_t count = 0;
+        file.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+        if (!file) {
+            cerr << "Warning: Failed to read profile '" << profilePath << "', ignoring it!" << endl;
+            return;
+        }
+
+        if (count != profile->indices.size()) {
+            cerr << "Warning: Profile '" << profilePath << "' has " << count << " branches but the program has "
+                 << profile->indices.size() << ", ignoring it!" << endl;
+            return;
+        }
+
+        vector<array<uint64_t, 2>> counts(count);
+        file.read(reinterpret_cast<char*>(counts.data()), (streamsize) (count * sizeof(array<uint64_t, 2>)));
+
+        if (!file) {
+            cerr << "Warning: Profile '" << profilePath << "' is truncated, ignoring it!" << endl;
+            return;
+        }
+
+        profile->counts = std::move(counts);
+
+    }
+
+    [[nodiscard]] BranchLayout branchLayout(const Node::StatementVariant::If* ifStatement) const {
+
+        if (profiling != Profiling::USE || profile->counts.empty()) return BranchLayout::FALL_THROUGH;
+
+        auto [executions, thenCount] = profile->counts[branchIndex(ifStatement)];
+        uint64_t elseCount = executions - min(thenCount, executions);
+        bool hasElse = ifStatement->elseStatement.has_value();
+
+        if (executions == 0) return BranchLayout::FALL_THROUGH;
+        if (thenCount * coldRatio <= elseCount) return BranchLayout::COLD_THEN;
+        if (hasElse && elseCount * coldRatio <= thenCount) return BranchLayout::COLD_ELSE;
+        if (hasElse && elseCount > thenCount) return BranchLayout::INVERTED;
+
+        return BranchLayout::FALL_THROUGH;
+
+    }
+
+    // Every exit of an instrumented program goes through here, the exit code is in rdi
+    void generateProfileExit() {
+
+        size_t count = profile->indices.size();
+
+        assembly << endl << profileExitLabel << ":" << endl
+                 << "    push rdi" << endl
+                 << "    mov rax, 2" << endl                        // open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                 << "    lea rdi, [rel __profile_path]" << endl
+                 << "    mov rsi, 577" << endl
+                 << "    mov rdx, 420" << endl
+                 << "    syscall" << endl
+                 << "    test rax, rax" << endl
+                 << "    js __profile_done" << endl
+                 << "    mov rdi, rax" << endl
+                 << "    push rdi" << endl
+                 << "    mov rax, 1" << endl                        // write(file, data, size)
+                 << "    lea rsi, [rel __profile_data]" << endl
+                 << "    mov rdx, " << 8 + count * 16 << endl
+                 << "    syscall" << endl
+                 << "    pop rdi" << endl
+                 << "    mov rax, 3" << endl                        // close(file)
+                 << "    syscall" << endl
+                 << "__profile_done:" << endl
+                 << "    pop rdi" << endl
+                 << "    mov rax, 60" << endl
+                 << "    syscall" << endl
+                 << "section .data" << endl
+                 << "__profile_data:" << endl
+                 << "    dq " << count << endl
+                 << profileCountersLabel << ":" << endl;
+
+        if (count > 0) assembly << "    times " << count * 2 << " dq 0" << endl;
+
+        // Written as numbers, so the path needs no escaping
+        assembly << "__profile_path:" << endl
+                 << "    db ";
+        for (unsigned char character : profilePath) assembly << (int) character << ", ";
+        assembly << "0";
+
+    }
+
+    // Line Information
+    void markLine(const Node::Statement* statement) {
+        // A scope has no code of its own, its statements are marked
+        if (lineInfoSource.empty() || holds_alternative<Node::Scope*>(statement->variant)) return;
+        assembly << "%line " << program.source->locate(statement->token).line << "+0 " << lineInfoSource << endl;
+    }
+
+    // Labels
+    string createLabel () {
+        return "label" + to_string(++labelCount);
+    }
+    size_t labelCount = 0;
+
+    stringstream assembly; // Output
 };
\ No newline at end of file
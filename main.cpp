@@ -3,20 +3,111 @@
 #include <sstream>
 #include <vector>
 #include <optional>
+#include <charconv>
 
 using namespace std;
 
 #include "tokenizer.h"
 #include "parser.h"
+#include "optimizer.h"
 #include "generator.h"
+#include "vm.h"
+#include "streaming.h"
 
 int main(int argc, char** args) {
 
     if (argc < 2) {
-        cerr << "Incorrect usage! Correct usage is: " << endl << args[0] << " <filename>" << endl;
+        cerr << "Incorrect usage! Correct usage is: " << endl << args[0] << " <filename> [-O0] [-Wunused] [-msse2 | -mavx2] [-j<jobs>] [-g] [--run] [--emit-bytecode=<file>] [-fprofile-generate=<file> | -fprofile-use=<file>] [--superoptimize=<table> | --superopt-table=<table>] [--stream[=<block size>]]" << endl;
         return EXIT_FAILURE;
     }
 
+    bool optimize = true;
+    bool warnUnused = false;
+    Isa isa = Isa::SCALAR;
+    size_t jobs = 1;
+    size_t requestedJobs = 1;
+    bool run = false;
+    bool lineInfo = false;
+    string bytecodePath;
+    Profiling profiling = Profiling::NONE;
+    string profilePath;
+    string superoptimizerTable;
+    bool superoptimize = false;
+    bool stream = false;
+    size_t blockSize = StreamingCompiler::defaultBlockSize;
+
+    for (int i = 2; i < argc; i++) {
+        string option = args[i];
+        if (option == "-O0") optimize = false;
+        else if (option == "-Wunused") warnUnused = true;
+        else if (option == "-msse2") isa = Isa::SSE2;
+        else if (option == "-mavx2") isa = Isa::AVX2;
+        else if (option == "-g") lineInfo = true;
+        else if (option == "--run") run = true;
+        else if (option == "--stream") stream = true;
+        else if (option.starts_with("--stream=") && option.size() > 9 && all_of(option.begin() + 9, option.end(), ::isdigit)
+                 && from_chars(option.data() + 9, option.data() + option.size(), blockSize).ec == errc()) {
+            stream = true;
+        }
+        else if (option.starts_with("--emit-bytecode=")) bytecodePath = option.substr(16);
+        else if (option.starts_with("--superoptimize=")) {
+            superoptimizerTable = option.substr(16);
+            superoptimize = true;
+        }
+        else if (option.starts_with("--superopt-table=")) superoptimizerTable = option.substr(17);
+        else if (option.starts_with("-fprofile-generate=") || option.starts_with("-fprofile-use=")) {
+            Profiling requested = option.starts_with("-fprofile-use=") ? Profiling::USE : Profiling::GENERATE;
+            if (profiling != Profiling::NONE && profiling != requested) {
+                cerr << "-fprofile-generate and -fprofile-use can't be combined!" << endl;
+                return EXIT_FAILURE;
+            }
+            profiling = requested;
+            profilePath = option.substr(option.find('=') + 1);
+        }
+        else if (option.starts_with("-j") && option.size() > 2 && all_of(option.begin() + 2, option.end(), ::isdigit)
+                 && from_chars(option.data() + 2, option.data() + option.size(), requestedJobs).ec == errc()) {
+            // More workers than cores only add overhead
+            jobs = clamp<size_t>(requestedJobs, 1, max(thread::hardware_concurrency(), 1u));
+        }
+        else {
+            cerr << "Unknown option '" << option << "'!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A streamed program is never in memory as a whole, so nothing that needs all of it can run. The Optimizer is
+    // skipped as well, its analyses span statements, so the output is always that of -O0. Pieces are generated one
+    // after the other, there are no independent statements to hand to workers.
+    if (stream) {
+
+        if (run || !bytecodePath.empty() || profiling != Profiling::NONE || superoptimize || warnUnused || requestedJobs > 1) {
+            cerr << "--stream can't be combined with --run, --emit-bytecode, -fprofile-*, --superoptimize, -Wunused or -j!" << endl;
+            return EXIT_FAILURE;
+        }
+
+        if (optimize) {
+            cerr << "--stream compiles without optimizations, it needs -O0!" << endl;
+            return EXIT_FAILURE;
+        }
+
+        optional<Superoptimizer> superoptimizer;
+        if (!superoptimizerTable.empty()) superoptimizer.emplace(superoptimizerTable);
+
+        Generator generator(Node::Program {}, isa, 1, lineInfo ? args[1] : "", Profiling::NONE, "", superoptimizer ? &*superoptimizer : nullptr);
+
+        fstream file("../out.asm", ios::out);
+        StreamingCompiler(args[1], generator, blockSize).compile(file);
+
+        return EXIT_SUCCESS;
+
+    }
+
+    // Compiled modules are mapped and executed as they are, without parsing anything
+    if (string_view(args[1]).ends_with(".nbc")) {
+        MappedModule module(args[1]);
+        return VirtualMachine(module.view()).run();
+    }
+
     string content;
     {
         stringstream sContent;
@@ -25,13 +116,44 @@ int main(int argc, char** args) {
         content = sContent.str();
     }
 
-    Tokenizer tokenizer(content);
-    vector<Token> tokens = tokenizer.tokenize();
+    Source source(std::move(content));
+
+    Tokenizer tokenizer(source);
+    vector<Token> tokens = tokenizer.tokenize(jobs);
 
-    Parser parser(tokens);
+    Parser parser(tokens, source);
     Node::Program root = parser.parse();
 
-    Generator generator(root);
+    Optimizer optimizer(root, warnUnused);
+    if (optimize) optimizer.optimize();
+    else if (warnUnused) optimizer.reportUnused();
+
+    // Execute in the virtual machine instead of emitting assembly, the exit code is passed through
+    if (run || !bytecodePath.empty()) {
+
+        Module module = BytecodeCompiler(root).compile();
+
+        if (!bytecodePath.empty()) {
+            module.save(bytecodePath);
+            if (!run) return EXIT_SUCCESS;
+        }
+
+        return VirtualMachine(module.view()).run();
+
+    }
+
+    // --superoptimize searches the shapes missing from the table and saves it, --superopt-table only looks them up
+    optional<Superoptimizer> superoptimizer;
+    if (!superoptimizerTable.empty()) {
+        superoptimizer.emplace(superoptimizerTable, superoptimize);
+        if (superoptimize) {
+            superoptimizer->search(root);
+            superoptimizer->save();
+        }
+    }
+
+    // The statements are split into as many tasks as requested, the Generator limits its threads to the cores itself
+    Generator generator(root, isa, requestedJobs, lineInfo ? args[1] : "", profiling, profilePath, superoptimizer ? &*superoptimizer : nullptr);
 
     {
         fstream file("../out.asm", ios::out);
@@ -0,0 +1,740 @@
+#pragma once
+
+#include <set>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include "parser.h"
+
+class Optimizer {
+
+public:
+    inline explicit Optimizer(Node::Program program, bool warnUnused = false):
+            program(program),
+            warnUnused(warnUnused),
+            allocator(1024 * 1024 * 4) // 4 MB
+    {}
+
+    inline void optimize() {
+        eliminateCommonSubexpressions(program.scope);
+        eliminateDeadStores();
+    }
+
+    // Reports what -Wunused reports, but leaves the program as it is. Stores that only become dead once others
+    // are removed are not found this way.
+    inline void reportUnused() {
+        rewrite = false;
+        eliminateDeadStores();
+    }
+
+private:
+
+    // Dead Store Elimination
+
+    struct Declaration {
+        Token token;
+        bool parameter = false;
+        size_t reads = 0;
+        size_t writes = 0;
+        bool conflicting = false; // Shadows or is shadowed by another declaration
+    };
+
+    vector<Declaration> declarations {};
+    map<const void*, size_t> bindings {}; // Let, Assign and Identifier nodes to their declaration
+    vector<size_t> visible {};
+    map<string_view, vector<size_t>> visibleByName {}; // The visible declarations of each name, innermost last
+
+    void eliminateDeadStores() {
+
+        // Every function has its own frame, so its body is analysed separately from the program
+        eliminateDeadStores(program.scope, {});
+
+        for (Node::Statement* statement : program.scope->statements) {
+            if (auto function = get_if<Node::StatementVariant::Function*>(&statement->variant)) {
+                eliminateDeadStores((*function)->scope, (*function)->parameters);
+            }
+        }
+
+    }
+
+    void eliminateDeadStores(Node::Scope* body, const vector<Token>& parameters) {
+
+        resolve(body, parameters);
+
+        if (warnUnused) {
+            for (const Declaration& declaration : declarations) {
+                if (declaration.reads > 0) continue;
+                Location location = program.source->locate(declaration.token);
+                cerr << "Warning: Unused " << (declaration.parameter ? "parameter" : "variable") << " '" << text(declaration.token)
+                     << "' at " << location.line << ":" << location.column << "!" << endl;
+            }
+        }
+
+        // Only the dead store warnings are left
+        if (!rewrite) {
+            bool changed = false;
+            removeDeadStores(body, changed);
+            return;
+        }
+
+        // Removing a store can leave the variables it read without readers, so repeat until nothing changes
+        bool changed = true;
+        while (changed) {
+
+            changed = false;
+
+            removeDeadStores(body, changed);
+
+            resolve(body, parameters);
+            removeUnusedLets(body, changed);
+
+            if (changed) resolve(body, parameters);
+
+        }
+
+    }
+
+    // Binds every variable reference to its declaration, mirroring the scoping of the Generator
+    void resolve(Node::Scope* body, const vector<Token>& parameters) {
+
+        declarations.clear();
+        bindings.clear();
+        visible.clear();
+        visibleByName.clear();
+
+        for (const Token& parameter : parameters) {
+            declarations.push_back({ .token = parameter, .parameter = true });
+            show(declarations.size() - 1);
+        }
+
+        // Statements still to resolve, entries without a statement close a scope
+        struct PendingStatement {
+            Node::Statement* statement = nullptr;
+            size_t mark = 0;
+        };
+
+        vector<PendingStatement> pending;
+        for (size_t i = body->statements.size(); i > 0; i--) pending.push_back({ .statement = body->statements[i - 1] });
+
+        while (!pending.empty()) {
+
+            PendingStatement item = pending.back();
+            pending.pop_back();
+
+            if (!item.statement) {
+                while (visible.size() > item.mark) hide();
+                continue;
+            }
+
+            Node::Statement* statement = item.statement;
+
+            if (auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant)) {
+
+                if ((*letStatement)->expression) resolve((*letStatement)->expression);
+
+                // The Generator rejects declarations that shadow a visible variable, neither of them may be removed
+                optional<size_t> shadowed = lookup((*letStatement)->identifierToken);
+                if (shadowed) declarations[shadowed.value()].conflicting = true;
+
+                bindings[*letStatement] = declarations.size();
+                declarations.push_back({ .token = (*letStatement)->identifierToken, .parameter = false, .conflicting = shadowed.has_value() });
+                show(declarations.size() - 1);
+
+            }
+            else if (auto assignStatement = get_if<Node::StatementVariant::Assign*>(&statement->variant)) {
+                resolve((*assignStatement)->expression);
+                if (auto declaration = lookup((*assignStatement)->identifierToken)) {
+                    bindings[*assignStatement] = declaration.value();
+                    declarations[declaration.value()].writes++;
+                }
+            }
+            else if (auto ifStatement = get_if<Node::StatementVariant::If*>(&statement->variant)) {
+                resolve((*ifStatement)->condition);
+                if ((*ifStatement)->elseStatement.has_value()) pending.push_back({ .statement = (*ifStatement)->elseStatement.value() });
+                pending.push_back({ .statement = (*ifStatement)->statement });
+            }
+            else if (auto scope = get_if<Node::Scope*>(&statement->variant)) {
+                pending.push_back({ .statement = nullptr, .mark = visible.size() });
+                for (size_t i = (*scope)->statements.size(); i > 0; i--) pending.push_back({ .statement = (*scope)->statements[i - 1] });
+            }
+            else if (auto expression = Node::evaluatedExpression(statement)) {
+                resolve(expression);
+            }
+
+        }
+
+    }
+
+    void resolve(const Node::Expression* expression) {
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&subexpression->variant)) {
+                if (auto declaration = lookup((*identifier)->value)) {
+                    bindings[*identifier] = declaration.value();
+                    declarations[declaration.value()].reads++;
+                }
+            }
+        });
+    }
+
+    // Undeclared identifiers stay unbound, the Generator reports them, so statements using them are never removed
+    optional<size_t> lookup(const Token& token) {
+        auto named = visibleByName.find(view(token));
+        if (named == visibleByName.end() || named->second.empty()) return {};
+        return named->second.back();
+    }
+
+    void show(size_t declaration) {
+        visible.push_back(declaration);
+        visibleByName[view(declarations[declaration].token)].push_back(declaration);
+    }
+
+    // Hides the innermost visible declaration
+    void hide() {
+        visibleByName[view(declarations[visible.back()].token)].pop_back();
+        visible.pop_back();
+    }
+
+    // Scopes and ifs whose statements are still being walked by removeDeadStores
+    struct DeadStoreFrame {
+        Node::Statement* statement = nullptr; // The if, or the scope statement, null for the body
+        Node::Scope* scope = nullptr;         // Set for scopes, whose statements before `index` are still to visit
+        size_t index = 0;
+        size_t live = 0;                      // Live sets by index, the else branch of an if starts with a copy
+        size_t liveElse = 0;
+    };
+
+    // Walks the statements backwards, `lives[live]` holds the declarations whose current value may still be read
+    void removeDeadStores(Node::Scope* body, bool& changed) {
+
+        vector<set<size_t>> lives(1);
+        vector<DeadStoreFrame> frames { { .statement = nullptr, .scope = body, .index = body->statements.size(), .live = 0 } };
+
+        // Whether the statement finished last can be dropped
+        optional<bool> result;
+
+        while (!frames.empty()) {
+
+            size_t top = frames.size() - 1;
+
+            if (Node::Scope* scope = frames[top].scope) {
+
+                if (rewrite && result.value_or(false)) {
+                    scope->statements.erase(scope->statements.begin() + (long) frames[top].index);
+                    changed = true;
+                }
+
+                if (frames[top].index == 0) {
+                    result = scope->statements.empty();
+                    frames.pop_back();
+                    continue;
+                }
+
+                frames[top].index--;
+                result = startDeadStores(scope->statements[frames[top].index], frames[top].live, lives, frames, changed);
+
+                continue;
+
+            }
+
+            auto conditional = get<Node::StatementVariant::If*>(frames[top].statement->variant);
+
+            // Index 0: nothing visited yet, 1: the then branch, 2: the else branch
+            if (frames[top].index == 0) {
+                frames[top].index = 1;
+                result = startDeadStores(conditional->statement, frames[top].live, lives, frames, changed);
+                continue;
+            }
+
+            if (frames[top].index == 1) {
+
+                if (rewrite && result.value() && !isEmpty(conditional->statement)) {
+                    conditional->statement = emptyStatement();
+                    changed = true;
+                }
+
+                if (conditional->elseStatement.has_value()) {
+                    frames[top].index = 2;
+                    result = startDeadStores(conditional->elseStatement.value(), frames[top].liveElse, lives, frames, changed);
+                    continue;
+                }
+
+            }
+            else if (rewrite && result.value() && !isEmpty(conditional->elseStatement.value())) {
+                conditional->elseStatement = emptyStatement();
+                changed = true;
+            }
+
+            set<size_t>& live = lives[frames[top].live];
+            live.insert(lives.back().cbegin(), lives.back().cend());
+            lives.pop_back();
+
+            addUses(conditional->condition, live);
+
+            bool emptyThen = isEmpty(conditional->statement);
+            bool emptyElse = !conditional->elseStatement.has_value() || isEmpty(conditional->elseStatement.value());
+
+            result = emptyThen && emptyElse && !mustKeep(conditional->condition);
+            frames.pop_back();
+
+        }
+
+    }
+
+    // Opens a frame for scopes and ifs, other statements are handled right away
+    optional<bool> startDeadStores(Node::Statement* statement, size_t live, vector<set<size_t>>& lives, vector<DeadStoreFrame>& frames, bool& changed) {
+
+        if (holds_alternative<Node::StatementVariant::If*>(statement->variant)) {
+            lives.push_back(lives[live]);
+            frames.push_back({ .statement = statement, .scope = nullptr, .index = 0, .live = live, .liveElse = lives.size() - 1 });
+            return {};
+        }
+
+        if (auto scope = get_if<Node::Scope*>(&statement->variant)) {
+            frames.push_back({ .statement = statement, .scope = *scope, .index = (*scope)->statements.size(), .live = live });
+            return {};
+        }
+
+        return removeDeadStore(statement, lives[live], changed);
+
+    }
+
+    // Returns true if the statement does nothing observable and can be dropped
+    bool removeDeadStore(Node::Statement* statement, set<size_t>& live, bool& changed) {
+
+        if (auto exitStatement = get_if<Node::StatementVariant::Exit*>(&statement->variant)) {
+            live.clear();
+            addUses((*exitStatement)->expression, live);
+        }
+        else if (auto returnStatement = get_if<Node::StatementVariant::Return*>(&statement->variant)) {
+            live.clear();
+            addUses((*returnStatement)->expression, live);
+        }
+        else if (auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant)) {
+
+            auto let = *letStatement;
+            size_t declaration = bindings.at(let);
+
+            // The slot is still needed if the variable is assigned and read later, only the initial value is dead
+            if (let->expression && !live.contains(declaration) && !mustKeep(let->expression)) {
+                if (warnUnused && declarations[declaration].reads > 0) reportDeadStore(let->identifierToken);
+                if (rewrite) {
+                    let->expression = nullptr;
+                    changed = true;
+                }
+            }
+
+            live.erase(declaration);
+            if (let->expression) addUses(let->expression, live);
+
+        }
+        else if (auto assignStatement = get_if<Node::StatementVariant::Assign*>(&statement->variant)) {
+
+            auto assign = *assignStatement;
+            auto binding = bindings.find(assign);
+
+            if (binding != bindings.end()) {
+
+                if (!live.contains(binding->second) && !mustKeep(assign->expression)) {
+                    if (warnUnused) reportDeadStore(assign->identifierToken);
+                    if (rewrite) return true;
+                }
+
+                live.erase(binding->second);
+
+            }
+
+            addUses(assign->expression, live);
+
+        }
+
+        return false;
+
+    }
+
+    // Drops declarations that are neither read nor written anymore
+    void removeUnusedLets(Node::Scope* body, bool& changed) {
+
+        vector<Node::Statement*> pending;
+
+        auto removeFrom = [&](Node::Scope* scope) {
+            for (size_t i = scope->statements.size(); i > 0; i--) {
+                if (isUnusedLet(scope->statements[i - 1])) {
+                    scope->statements.erase(scope->statements.begin() + (long) i - 1);
+                    changed = true;
+                }
+                else pending.push_back(scope->statements[i - 1]);
+            }
+        };
+
+        removeFrom(body);
+
+        while (!pending.empty()) {
+
+            Node::Statement* statement = pending.back();
+            pending.pop_back();
+
+            if (auto ifStatement = get_if<Node::StatementVariant::If*>(&statement->variant)) {
+
+                if (isUnusedLet((*ifStatement)->statement)) {
+                    (*ifStatement)->statement = emptyStatement();
+                    changed = true;
+                }
+                else pending.push_back((*ifStatement)->statement);
+
+                if ((*ifStatement)->elseStatement.has_value()) {
+                    if (isUnusedLet((*ifStatement)->elseStatement.value())) {
+                        (*ifStatement)->elseStatement = emptyStatement();
+                        changed = true;
+                    }
+                    else pending.push_back((*ifStatement)->elseStatement.value());
+                }
+
+            }
+            else if (auto scope = get_if<Node::Scope*>(&statement->variant)) {
+                removeFrom(*scope);
+            }
+
+        }
+
+    }
+
+    bool isUnusedLet(const Node::Statement* statement) {
+
+        auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant);
+        if (!letStatement) return false;
+
+        const Declaration& declaration = declarations[bindings.at(*letStatement)];
+        const Node::Expression* expression = (*letStatement)->expression;
+
+        return declaration.reads == 0 && declaration.writes == 0 && !declaration.conflicting && (!expression || !mustKeep(expression));
+
+    }
+
+    // Common Subexpression Elimination
+
+    // Number of statements after the first occurrence that are searched for repetitions
+    static constexpr size_t cseWindow = 32;
+    size_t temporaryCount = 0;
+
+    // Equal subtrees get the same value number, 0 stands for subtrees containing a call
+    map<string, size_t> leafNumbers {};
+    map<tuple<char, size_t, size_t>, size_t> termNumbers {};
+    size_t valueNumberCount = 0;
+
+    struct Occurrence {
+        size_t number;
+        Node::Expression* expression;
+    };
+
+    // Scopes are processed after everything nested in them, like a post-order walk
+    struct CseWork {
+        Node::Scope* scope = nullptr;       // A scope to process
+        Node::Statement** branch = nullptr; // Or a single statement branch that may need a scope around it
+        bool expanded = false;              // Whether the nested scopes are already processed
+    };
+
+    void eliminateCommonSubexpressions(Node::Scope* body) {
+
+        vector<CseWork> work { { .scope = body } };
+
+        while (!work.empty()) {
+
+            CseWork item = work.back();
+            work.pop_back();
+
+            if (item.expanded) {
+                if (item.branch) wrapBranch(*item.branch, item.scope);
+                else hoistCommonSubexpressions(item.scope);
+                continue;
+            }
+
+            if (item.scope) {
+                work.push_back({ .scope = item.scope, .expanded = true });
+                for (size_t i = item.scope->statements.size(); i > 0; i--) pushNested(item.scope->statements[i - 1], work);
+                continue;
+            }
+
+            Node::Statement* branch = *item.branch;
+
+            if (holds_alternative<Node::Scope*>(branch->variant) || holds_alternative<Node::StatementVariant::If*>(branch->variant)) {
+                pushNested(branch, work);
+                continue;
+            }
+
+            // A let in a branch declares into the enclosing scope, wrapping it would change that
+            if (holds_alternative<Node::StatementVariant::Let*>(branch->variant)) continue;
+
+            auto scope = allocator.allocate<Node::Scope>();
+            scope->statements.push_back(branch);
+
+            work.push_back({ .scope = scope, .branch = item.branch, .expanded = true });
+            pushNested(branch, work);
+
+        }
+
+    }
+
+    // Queues the scopes and branches directly nested in the statement
+    static void pushNested(Node::Statement* statement, vector<CseWork>& work) {
+
+        if (auto ifStatement = get_if<Node::StatementVariant::If*>(&statement->variant)) {
+            if ((*ifStatement)->elseStatement.has_value()) work.push_back({ .scope = nullptr, .branch = &(*ifStatement)->elseStatement.value() });
+            work.push_back({ .scope = nullptr, .branch = &(*ifStatement)->statement });
+        }
+        else if (auto scope = get_if<Node::Scope*>(&statement->variant)) {
+            work.push_back({ .scope = *scope });
+        }
+        else if (auto function = get_if<Node::StatementVariant::Function*>(&statement->variant)) {
+            work.push_back({ .scope = (*function)->scope });
+        }
+
+    }
+
+    // Single statement branches get wrapped into a scope if a temporary has to be placed in front of them
+    void wrapBranch(Node::Statement*& branch, Node::Scope* scope) {
+
+        hoistCommonSubexpressions(scope);
+
+        if (scope->statements.size() > 1) {
+            Token token = branch->token;
+            branch = allocator.allocate<Node::Statement>();
+            branch->variant = scope;
+            branch->token = token;
+        }
+
+    }
+
+    void hoistCommonSubexpressions(Node::Scope* scope) {
+
+        // A function that is a single return stays in shape for the inliner
+        if (scope->statements.size() == 1 && holds_alternative<Node::StatementVariant::Return*>(scope->statements.front()->variant)) return;
+
+        for (size_t start = 0; start < scope->statements.size(); start++) {
+            // The temporary is inserted at `start`, so look at it again for subexpressions of its own
+            while (hoistCommonSubexpression(scope, start)) {}
+        }
+
+    }
+
+    // Moves the first subexpression of the statement at `start` that is evaluated again before any of its
+    // operands change into a temporary and replaces all of its occurrences
+    bool hoistCommonSubexpression(Node::Scope* scope, size_t start) {
+
+        Node::Statement* statement = scope->statements[start];
+
+        // Terms of the straight line statements starting at `start`, a candidate can only repeat within them
+        vector<vector<Occurrence>> window;
+        map<size_t, size_t> counts;
+
+        for (size_t index = start; index < scope->statements.size() && index <= start + cseWindow; index++) {
+
+            const Node::Statement* current = scope->statements[index];
+            Node::Expression* expression = Node::evaluatedExpression(current);
+            if (!expression) break;
+
+            window.emplace_back();
+            collectTerms(expression, window.back());
+
+            for (const Occurrence& term : window.back()) counts[term.number]++;
+
+            // Control leaves the straight line code after these
+            if (!holds_alternative<Node::StatementVariant::Let*>(current->variant) && !holds_alternative<Node::StatementVariant::Assign*>(current->variant)) break;
+
+        }
+
+        if (window.empty()) return false;
+
+        for (const Occurrence& candidate : window.front()) {
+
+            if (candidate.number == 0 || counts[candidate.number] < 2) continue;
+
+            vector<string> operands;
+            collectIdentifiers(candidate.expression, operands);
+
+            if (auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant)) {
+                if (find(operands.cbegin(), operands.cend(), text((*letStatement)->identifierToken)) != operands.cend()) continue;
+            }
+
+            vector<Node::Expression*> occurrences;
+
+            for (size_t offset = 0; offset < window.size(); offset++) {
+
+                for (const Occurrence& term : window[offset]) {
+                    if (term.number == candidate.number) occurrences.push_back(term.expression);
+                }
+
+                if (writesAny(scope->statements[start + offset], operands)) break;
+
+            }
+
+            if (occurrences.size() < 2) continue;
+
+            // '_' can't start a source identifier
+            Token token = program.source->synthesize(TokenType::IDENTIFIER, "_cse" + to_string(++temporaryCount));
+
+            auto hoisted = allocator.allocate<Node::Expression>();
+            hoisted->variant = candidate.expression->variant;
+
+            auto letStatement = allocator.allocate<Node::StatementVariant::Let>();
+            letStatement->identifierToken = token;
+            letStatement->expression = hoisted;
+
+            auto temporary = allocator.allocate<Node::Statement>();
+            temporary->variant = letStatement;
+            temporary->token = statement->token;
+
+            for (Node::Expression* occurrence : occurrences) {
+                auto identifier = allocator.allocate<Node::ExpressionVariant::Identifier>();
+                identifier->value = token;
+                occurrence->variant = identifier;
+            }
+
+            scope->statements.insert(scope->statements.begin() + (long) start, temporary);
+
+            return true;
+
+        }
+
+        return false;
+
+    }
+
+    // Appends all terms in pre-order together with the value number of their subtree
+    void collectTerms(Node::Expression* expression, vector<Occurrence>& terms) {
+
+        vector<Node::Expression*> order;
+        Node::forEachExpression(expression, [&](Node::Expression* subexpression) { order.push_back(subexpression); });
+
+        // In reverse pre-order every subexpression comes before the expression containing it
+        map<const Node::Expression*, size_t> numbers;
+
+        for (size_t i = order.size(); i > 0; i--) {
+
+            const Node::Expression* current = order[i - 1];
+            size_t number = 0;
+
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&current->variant)) {
+                number = leafNumber(text((*identifier)->value));
+            }
+            else if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&current->variant)) {
+                number = leafNumber(text((*integer)->value));
+            }
+            else if (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&current->variant)) {
+                number = numbers.at((*brackets)->expression);
+            }
+            else if (auto term = get_if<Node::ExpressionVariant::Term*>(&current->variant)) {
+
+                auto [left, right] = visit([&](auto* binary) {
+                    return pair { numbers.at(binary->left), numbers.at(binary->right) };
+                }, (*term)->variant);
+
+                if (left != 0 && right != 0) number = termNumber(termOperator(*term), left, right);
+
+            }
+
+            numbers[current] = number;
+
+        }
+
+        for (Node::Expression* current : order) {
+            if (holds_alternative<Node::ExpressionVariant::Term*>(current->variant)) {
+                terms.push_back({ .number = numbers.at(current), .expression = current });
+            }
+        }
+
+    }
+
+    size_t leafNumber(const string& value) {
+        auto [it, inserted] = leafNumbers.try_emplace(value, valueNumberCount + 1);
+        if (inserted) valueNumberCount++;
+        return it->second;
+    }
+
+    size_t termNumber(char operation, size_t left, size_t right) {
+        auto [it, inserted] = termNumbers.try_emplace({ operation, left, right }, valueNumberCount + 1);
+        if (inserted) valueNumberCount++;
+        return it->second;
+    }
+
+    static char termOperator(const Node::ExpressionVariant::Term* term) {
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Addition*>(term->variant)) return '+';
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Subtraction*>(term->variant)) return '-';
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Multiplication*>(term->variant)) return '*';
+        return '/';
+    }
+
+    void collectIdentifiers(const Node::Expression* expression, vector<string>& identifiers) {
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&subexpression->variant)) {
+                identifiers.push_back(text((*identifier)->value));
+            }
+        });
+    }
+
+    bool writesAny(const Node::Statement* statement, const vector<string>& identifiers) {
+
+        const Token* target = nullptr;
+
+        if (auto letStatement = get_if<Node::StatementVariant::Let*>(&statement->variant)) target = &(*letStatement)->identifierToken;
+        if (auto assignStatement = get_if<Node::StatementVariant::Assign*>(&statement->variant)) target = &(*assignStatement)->identifierToken;
+
+        return target && find(identifiers.cbegin(), identifiers.cend(), text(*target)) != identifiers.cend();
+
+    }
+
+    void reportDeadStore(const Token& token) {
+        Location location = program.source->locate(token);
+        cerr << "Warning: Dead store to '" << text(token) << "' at " << location.line << ":" << location.column << "!" << endl;
+    }
+
+    void addUses(const Node::Expression* expression, set<size_t>& live) {
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&subexpression->variant)) {
+                auto binding = bindings.find(*identifier);
+                if (binding != bindings.end()) live.insert(binding->second);
+            }
+        });
+    }
+
+    // Calls may exit, so expressions containing them are never dropped
+    // Calls may have side effects and unbound identifiers are errors the Generator still has to report
+    [[nodiscard]] bool mustKeep(const Node::Expression* expression) const {
+
+        bool found = false;
+
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&subexpression->variant)) {
+                found = found || !bindings.contains(*identifier);
+            }
+            else found = found || holds_alternative<Node::ExpressionVariant::Call*>(subexpression->variant);
+        });
+
+        return found;
+
+    }
+
+    static bool isEmpty(const Node::Statement* statement) {
+        auto scope = get_if<Node::Scope*>(&statement->variant);
+        return scope && (*scope)->statements.empty();
+    }
+
+    Node::Statement* emptyStatement() {
+        auto statement = allocator.allocate<Node::Statement>();
+        statement->variant = allocator.allocate<Node::Scope>();
+        return statement;
+    }
+
+    [[nodiscard]] string_view view(const Token& token) const {
+        return program.source->view(token);
+    }
+
+    [[nodiscard]] string text(const Token& token) const {
+        return program.source->value(token);
+    }
+
+    const Node::Program program;
+    const bool warnUnused;
+    bool rewrite = true; // Off when only the warnings are wanted
+
+    ArenaAllocator allocator;
+};
@@ -1,386 +1,696 @@
-#pragma once
-
-#include <variant>
-
-#include "tokenizer.h"
-
-#include "arena.h"
-
-namespace Node {
-
-    struct Scope;
-    struct Statement;
-    struct Expression;
-
-    namespace ExpressionVariant {
-
-        struct Identifier {
-            Token value;
-        };
-
-        struct Integer {
-            Token value;
-        };
-
-        struct RoundBrackets {
-            Expression* expression;
-        };
-
-        namespace TermVariant {
-
-            struct Addition {
-                Expression* left;
-                Expression* right;
-            };
-
-            struct Subtraction {
-                Expression* left;
-                Expression* right;
-            };
-
-            struct Multiplication {
-                Expression* left;
-                Expression* right;
-            };
-
-            struct Division {
-                Expression* left;
-                Expression* right;
-            };
-
-        }
-
-        struct Term {
-            variant<TermVariant::Multiplication*, TermVariant::Division*, TermVariant::Addition*, TermVariant::Subtraction*> variant;
-        };
-
-    }
-
-    struct Expression {
-        variant<Node::ExpressionVariant::Identifier*, Node::ExpressionVariant::Integer*, Node::ExpressionVariant::RoundBrackets*, Node::ExpressionVariant::Term*> variant;
-    };
-
-    namespace StatementVariant {
-
-        struct Exit {
-            Expression* expression;
-        };
-
-        struct Let {
-            Token identifierToken;
-            Expression* expression {};
-        };
-
-        struct Assign {
-            Token identifierToken;
-            Expression* expression {};
-        };
-
-        struct If {
-            Expression* condition{};
-            Statement* statement{};
-            optional<Statement*> elseStatement;
-        };
-
-    }
-
-    // TODO Refactor code to use "using" instead of "struct"
-    struct Statement {
-        variant<StatementVariant::Exit*, StatementVariant::Let*, StatementVariant::Assign*, StatementVariant::If*, Scope*> variant;
-    };
-
-    struct Scope {
-        vector<Statement*> statements;
-    };
-
-    struct Program {
-        Scope* scope;
-    };
-
-}
-
-class Parser {
-
-public:
-    inline explicit Parser (vector<Token> tokens):
-        tokens(std::move(tokens)),
-        allocator(1024 * 1024 * 4) // 4 MB
-    {}
-
-    inline Node::Program parse() {
-        return Node::Program { .scope = parseScope() };
-    }
-
-private:
-
-    inline Node::Scope* parseScope() {
-
-        auto scope = allocator.allocate<Node::Scope>();
-
-        while (hasNext()) {
-            auto statement = parseStatement();
-            if (!statement.has_value()) break;
-            scope->statements.push_back(statement.value());
-        }
-
-        return scope;
-
-    }
-
-    inline optional<Node::Statement*> parseStatement() {
-
-        auto statement = allocator.allocate<Node::Statement>();
-
-        if (!hasNext()) return {};
-
-        switch (get().type) {
-
-            case TokenType::EXIT: {
-
-                auto exitStatement = allocator.allocate<Node::StatementVariant::Exit>();
-
-                next();
-
-                exitStatement->expression = parseExpression();
-
-                statement->variant = exitStatement;
-
-                break;
-
-            }
-
-            case TokenType::LET: {
-
-                auto letStatement = allocator.allocate<Node::StatementVariant::Let>();
-
-                next();
-
-                if (get().type != TokenType::IDENTIFIER) raise("Failed to parse Expression! Identifier expected", get().line);
-
-                letStatement->identifierToken = get();
-                next();
-
-                if (get().type == TokenType::EQUALS) {
-                    next();
-                } else raise("Failed to parse Expression! '=' expected", get().line);
-
-                letStatement->expression = parseExpression();
-
-                statement->variant = letStatement;
-
-                break;
-
-            }
-
-            case TokenType::IDENTIFIER: {
-
-                auto assignmentStatement = allocator.allocate<Node::StatementVariant::Assign>();
-
-                assignmentStatement->identifierToken = get();
-                next();
-
-                if (get().type == TokenType::EQUALS) {
-                    next();
-                } else raise("Failed to parse Expression! '=' expected", get().line);
-
-                assignmentStatement->expression = parseExpression();
-
-                statement->variant = assignmentStatement;
-
-                break;
-
-            }
-
-            case TokenType::IF: {
-
-                auto ifStatement = allocator.allocate<Node::StatementVariant::If>();
-
-                next();
-
-                ifStatement->condition = parseExpression();
-                ifStatement->statement = parseStatement().value();
-
-                if (hasNext() && get().type == TokenType::ELSE) {
-                    next();
-                    ifStatement->elseStatement = parseStatement().value();
-                }
-
-                statement->variant = ifStatement;
-
-                return statement;
-
-            }
-
-            case TokenType::OPEN_CURLY_BRACKET: {
-                next();
-
-                auto scope = parseScope();
-
-                if (get().type == TokenType::CLOSED_CURLY_BRACKET) next();
-                else raise("Failed to parse Expression! '}' expected", get().line);
-
-                statement->variant = scope;
-
-                return statement;
-
-            }
-
-            case TokenType::CLOSED_CURLY_BRACKET: {
-
-                return {};
-
-            }
-
-            default: raise("Failed to parse Expression! Unknown token", get().line, get().column);
-
-        }
-
-        if (get().type == TokenType::SEMICOLON) next();
-        else raise("Failed to parse Expression! ';' expected", get().line);
-
-        return statement;
-
-    }
-
-    inline Node::Expression* parseExpression(int minPrecedence = 1) {
-
-        Node::Expression* expression;
-
-        if (get().type == TokenType::INTEGER) {
-
-            auto integerExpression = allocator.allocate<Node::ExpressionVariant::Integer>();
-            integerExpression->value = get();
-
-            next();
-
-            expression = allocator.allocate<Node::Expression>();
-            expression->variant = integerExpression;
-
-        }
-        else if (get().type == TokenType::IDENTIFIER) {
-
-            auto identifierExpression = allocator.allocate<Node::ExpressionVariant::Identifier>();
-            identifierExpression->value = get();
-
-            next();
-
-            expression = allocator.allocate<Node::Expression>();
-            expression->variant = identifierExpression;
-
-        } else if (get().type == TokenType::OPEN_ROUND_BRACKET) {
-
-            auto roundBracketExpression = allocator.allocate<Node::ExpressionVariant::RoundBrackets>();
-
-            next();
-
-            roundBracketExpression->expression = parseExpression();
-
-            if (get().type == TokenType::CLOSED_ROUND_BRACKET) {
-                next();
-            } else {
-                raise("Failed to parse Expression! ')' expected", get().line);
-            }
-
-            expression = allocator.allocate<Node::Expression>();
-            expression->variant = roundBracketExpression;
-
-
-        } else raise("Failed to parse Expression! Unexpected Token", get().line, get().column);
-
-        while (true) {
-
-            TokenType operatorType = get().type;
-
-            if (auto precedence = getBinaryPrecedence(operatorType)) {
-
-                if (precedence.value() < minPrecedence) break;
-
-                next();
-
-                int nextMinPrecedence = precedence.value() + 1;
-
-                auto term = allocator.allocate<Node::ExpressionVariant::Term>();
-
-                switch (operatorType) {
-                    case TokenType::PLUS: {
-                        auto additionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Addition>();
-                        additionTerm->left = expression;
-                        additionTerm->right = parseExpression(nextMinPrecedence);
-                        term->variant = additionTerm;
-                        break;
-                    }
-                    case TokenType::MINUS: {
-                        auto subtractionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Subtraction>();
-                        subtractionTerm->left = expression;
-                        subtractionTerm->right = parseExpression(nextMinPrecedence);
-                        term->variant = subtractionTerm;
-                        break;
-                    }
-                    case TokenType::ASTERISK: {
-                        auto multiplicationTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Multiplication>();
-                        multiplicationTerm->left = expression;
-                        multiplicationTerm->right = parseExpression(nextMinPrecedence);
-                        term->variant = multiplicationTerm;
-                        break;
-                    }
-                    case TokenType::SLASH: {
-                        auto divisionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Division>();
-                        divisionTerm->left = expression;
-                        divisionTerm->right = parseExpression(nextMinPrecedence);
-                        term->variant = divisionTerm;
-                        break;
-                    }
-                    default: raise("Failed to parse Therm! Unexpected Operator Type", get().line, get().column);
-                }
-
-                expression = allocator.allocate<Node::Expression>();
-                expression->variant = term;
-
-            } else break;
-
-        }
-
-        return expression;
-
-    }
-    // Allocation
-    ArenaAllocator allocator;
-
-    // Tokens
-    const vector<Token> tokens;
-    size_t pointer = 0;
-
-    inline Token peek(int ahead = 1) {
-        return tokens.at(pointer + ahead);
-    }
-
-    inline Token get() {
-
-        if (!hasNext()) {
-            cerr << "Unexpected End Exception! Tried to access value out of bounds!" << endl;
-            exit(EXIT_FAILURE);
-        }
-
-        return tokens.at(pointer);
-    }
-
-    inline void next() {
-        pointer++;
-    }
-
-    [[nodiscard]] inline bool hasNext() const {
-        return pointer < tokens.size();
-    }
-
-    // Errors
-    static void raise(const string& message, size_t line, size_t column) {
-        cerr << message << " at " << line << ":" << column << "!" << endl;
-        exit(EXIT_FAILURE);
-    }
-
-    static void raise(const string& message, size_t line) {
-        cerr << message << " at line " << line << "!" << endl;
-        exit(EXIT_FAILURE);
-    }
-
+#pragma once
+
+#include <variant>
+
+#include "tokenizer.h"
+
+#include "arena.h"
+
+namespace Node {
+
+    struct Scope;
+    struct Statement;
+    struct Expression;
+
+    namespace ExpressionVariant {
+
+        struct Identifier {
+            Token value;
+        };
+
+        struct Integer {
+            Token value;
+        };
+
+        struct RoundBrackets {
+            Expression* expression;
+        };
+
+        struct Call {
+            Token identifierToken;
+            vector<Expression*> arguments;
+        };
+
+        namespace TermVariant {
+
+            struct Addition {
+                Expression* left;
+                Expression* right;
+            };
+
+            struct Subtraction {
+                Expression* left;
+                Expression* right;
+            };
+
+            struct Multiplication {
+                Expression* left;
+                Expression* right;
+            };
+
+            struct Division {
+                Expression* left;
+                Expression* right;
+            };
+
+        }
+
+        struct Term {
+            variant<TermVariant::Multiplication*, TermVariant::Division*, TermVariant::Addition*, TermVariant::Subtraction*> variant;
+        };
+
+    }
+
+    struct Expression {
+        variant<Node::ExpressionVariant::Identifier*, Node::ExpressionVariant::Integer*, Node::ExpressionVariant::RoundBrackets*, Node::ExpressionVariant::Term*, Node::ExpressionVariant::Call*> variant;
+    };
+
+    namespace StatementVariant {
+
+        struct Exit {
+            Expression* expression;
+        };
+
+        struct Let {
+            Token identifierToken;
+            Expression* expression {};
+        };
+
+        struct Assign {
+            Token identifierToken;
+            Expression* expression {};
+        };
+
+        struct If {
+            Expression* condition{};
+            Statement* statement{};
+            optional<Statement*> elseStatement;
+        };
+
+        struct Function {
+            Token identifierToken;
+            vector<Token> parameters;
+            Scope* scope {};
+        };
+
+        struct Return {
+            Expression* expression;
+        };
+
+    }
+
+    // TODO Refactor code to use "using" instead of "struct"
+    struct Statement {
+        variant<StatementVariant::Exit*, StatementVariant::Let*, StatementVariant::Assign*, StatementVariant::If*, StatementVariant::Function*, StatementVariant::Return*, Scope*> variant;
+        Token token {}; // First token of the statement, for line information
+    };
+
+    struct Scope {
+        vector<Statement*> statements;
+    };
+
+    struct Program {
+        Scope* scope;
+        Source* source; // Text of all tokens in the tree
+    };
+
+    // Traversal without recursion, nesting depth is only limited by memory
+
+    // Pushes the direct subexpressions in reverse, so they are popped from left to right
+    template <typename ExpressionPointer>
+    inline void pushSubexpressions(ExpressionPointer expression, vector<ExpressionPointer>& stack) {
+
+        if (auto brackets = get_if<ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            stack.push_back((*brackets)->expression);
+        }
+        else if (auto call = get_if<ExpressionVariant::Call*>(&expression->variant)) {
+            for (size_t i = (*call)->arguments.size(); i > 0; i--) stack.push_back((*call)->arguments[i - 1]);
+        }
+        else if (auto term = get_if<ExpressionVariant::Term*>(&expression->variant)) {
+            visit([&](auto* binary) {
+                stack.push_back(binary->right);
+                stack.push_back(binary->left);
+            }, (*term)->variant);
+        }
+
+    }
+
+    // Calls `visitor` for the expression and all of its subexpressions in pre-order
+    template <typename ExpressionPointer, typename Visitor>
+    inline void forEachExpression(ExpressionPointer expression, Visitor visitor) {
+
+        vector<ExpressionPointer> stack { expression };
+
+        while (!stack.empty()) {
+            ExpressionPointer current = stack.back();
+            stack.pop_back();
+            visitor(current);
+            pushSubexpressions(current, stack);
+        }
+
+    }
+
+    // Calls `visitor` for the statement and all statements nested in it in pre-order, function bodies excluded
+    template <typename Visitor>
+    inline void forEachStatement(const Statement* statement, Visitor visitor) {
+
+        vector<const Statement*> stack { statement };
+
+        while (!stack.empty()) {
+
+            const Statement* current = stack.back();
+            stack.pop_back();
+            visitor(current);
+
+            if (auto ifStatement = get_if<StatementVariant::If*>(&current->variant)) {
+                if ((*ifStatement)->elseStatement.has_value()) stack.push_back((*ifStatement)->elseStatement.value());
+                stack.push_back((*ifStatement)->statement);
+            }
+            else if (auto scope = get_if<Scope*>(&current->variant)) {
+                for (size_t i = (*scope)->statements.size(); i > 0; i--) stack.push_back((*scope)->statements[i - 1]);
+            }
+
+        }
+
+    }
+
+    // The expression a statement always evaluates, if any
+    inline Expression* evaluatedExpression(const Statement* statement) {
+
+        if (auto exitStatement = get_if<StatementVariant::Exit*>(&statement->variant)) return (*exitStatement)->expression;
+        if (auto returnStatement = get_if<StatementVariant::Return*>(&statement->variant)) return (*returnStatement)->expression;
+        if (auto letStatement = get_if<StatementVariant::Let*>(&statement->variant)) return (*letStatement)->expression;
+        if (auto assignStatement = get_if<StatementVariant::Assign*>(&statement->variant)) return (*assignStatement)->expression;
+        if (auto ifStatement = get_if<StatementVariant::If*>(&statement->variant)) return (*ifStatement)->condition;
+
+        return nullptr;
+
+    }
+
+}
+
+class Parser {
+
+public:
+    inline explicit Parser (vector<Token> tokens, Source& source):
+        tokens(std::move(tokens)),
+        source(source),
+        allocator(1024 * 1024 * 4) // 4 MB
+    {}
+
+    inline Node::Program parse() {
+        return Node::Program { .scope = parseScope(), .source = &source };
+    }
+
+private:
+
+    // Statements are parsed with an explicit stack of the constructs that are still open,
+    // so deeply nested scopes and long else if chains don't grow the call stack
+    struct OpenStatement {
+        enum class Kind { SCOPE, BLOCK, FUNCTION, IF, ELSE } kind;
+        Node::Statement* statement = nullptr; // The statement the construct becomes
+        Node::Scope* scope = nullptr;         // Collects the statements of SCOPE, BLOCK and FUNCTION
+    };
+
+    inline Node::Scope* parseScope() {
+
+        auto scope = allocator.allocate<Node::Scope>();
+
+        vector<OpenStatement> open { { .kind = OpenStatement::Kind::SCOPE, .scope = scope } };
+
+        while (true) {
+
+            OpenStatement& top = open.back();
+
+            bool collectsStatements = top.kind == OpenStatement::Kind::SCOPE || top.kind == OpenStatement::Kind::BLOCK || top.kind == OpenStatement::Kind::FUNCTION;
+
+            if (collectsStatements) {
+
+                if (top.kind == OpenStatement::Kind::SCOPE && (!hasNext() || get().type == TokenType::CLOSED_CURLY_BRACKET)) {
+                    return scope;
+                }
+
+                if (top.kind != OpenStatement::Kind::SCOPE && get().type == TokenType::CLOSED_CURLY_BRACKET) {
+
+                    next();
+
+                    Node::Statement* statement = top.statement;
+                    open.pop_back();
+                    complete(open, statement);
+
+                    continue;
+
+                }
+
+            } else if (get().type == TokenType::CLOSED_CURLY_BRACKET) {
+                raise("Failed to parse Expression! Statement expected", line(get()));
+            }
+
+            if (auto statement = parseStatement(open)) complete(open, statement.value());
+
+        }
+
+    }
+
+    // Hands a finished statement to the innermost open construct, closing every if it completes
+    inline void complete(vector<OpenStatement>& open, Node::Statement* statement) {
+
+        while (true) {
+
+            OpenStatement& top = open.back();
+
+            switch (top.kind) {
+
+                case OpenStatement::Kind::SCOPE:
+                case OpenStatement::Kind::BLOCK:
+                case OpenStatement::Kind::FUNCTION: {
+                    top.scope->statements.push_back(statement);
+                    return;
+                }
+
+                case OpenStatement::Kind::IF: {
+
+                    auto ifStatement = std::get<Node::StatementVariant::If*>(top.statement->variant);
+                    ifStatement->statement = statement;
+
+                    if (hasNext() && get().type == TokenType::ELSE) {
+                        next();
+                        top.kind = OpenStatement::Kind::ELSE;
+                        return;
+                    }
+
+                    break;
+
+                }
+
+                case OpenStatement::Kind::ELSE: {
+                    std::get<Node::StatementVariant::If*>(top.statement->variant)->elseStatement = statement;
+                    break;
+                }
+
+            }
+
+            statement = top.statement;
+            open.pop_back();
+
+        }
+
+    }
+
+    // Parses a simple statement and returns it, or opens a construct whose statements follow
+    inline optional<Node::Statement*> parseStatement(vector<OpenStatement>& open) {
+
+        auto statement = allocator.allocate<Node::Statement>();
+        statement->token = get();
+
+        switch (get().type) {
+
+            case TokenType::EXIT: {
+
+                auto exitStatement = allocator.allocate<Node::StatementVariant::Exit>();
+
+                next();
+
+                exitStatement->expression = parseExpression();
+
+                statement->variant = exitStatement;
+
+                break;
+
+            }
+
+            case TokenType::LET: {
+
+                auto letStatement = allocator.allocate<Node::StatementVariant::Let>();
+
+                next();
+
+                if (get().type != TokenType::IDENTIFIER) raise("Failed to parse Expression! Identifier expected", line(get()));
+
+                letStatement->identifierToken = get();
+                next();
+
+                if (get().type == TokenType::EQUALS) {
+                    next();
+                } else raise("Failed to parse Expression! '=' expected", line(get()));
+
+                letStatement->expression = parseExpression();
+
+                statement->variant = letStatement;
+
+                break;
+
+            }
+
+            case TokenType::IDENTIFIER: {
+
+                auto assignmentStatement = allocator.allocate<Node::StatementVariant::Assign>();
+
+                assignmentStatement->identifierToken = get();
+                next();
+
+                if (get().type == TokenType::EQUALS) {
+                    next();
+                } else raise("Failed to parse Expression! '=' expected", line(get()));
+
+                assignmentStatement->expression = parseExpression();
+
+                statement->variant = assignmentStatement;
+
+                break;
+
+            }
+
+            case TokenType::IF: {
+
+                auto ifStatement = allocator.allocate<Node::StatementVariant::If>();
+
+                next();
+
+                ifStatement->condition = parseExpression();
+
+                statement->variant = ifStatement;
+
+                open.push_back({ .kind = OpenStatement::Kind::IF, .statement = statement });
+
+                return {};
+
+            }
+
+            case TokenType::FN: {
+
+                auto functionStatement = allocator.allocate<Node::StatementVariant::Function>();
+
+                next();
+
+                if (get().type != TokenType::IDENTIFIER) raise("Failed to parse Function! Identifier expected", line(get()));
+
+                functionStatement->identifierToken = get();
+                next();
+
+                if (get().type == TokenType::OPEN_ROUND_BRACKET) next();
+                else raise("Failed to parse Function! '(' expected", line(get()));
+
+                while (get().type != TokenType::CLOSED_ROUND_BRACKET) {
+
+                    if (get().type != TokenType::IDENTIFIER) raise("Failed to parse Function! Parameter expected", line(get()), column(get()));
+
+                    functionStatement->parameters.push_back(get());
+                    next();
+
+                    if (get().type == TokenType::COMMA) next();
+                    else if (get().type != TokenType::CLOSED_ROUND_BRACKET) raise("Failed to parse Function! ',' or ')' expected", line(get()));
+
+                }
+
+                next();
+
+                if (get().type == TokenType::OPEN_CURLY_BRACKET) next();
+                else raise("Failed to parse Function! '{' expected", line(get()));
+
+                functionStatement->scope = allocator.allocate<Node::Scope>();
+
+                statement->variant = functionStatement;
+
+                open.push_back({ .kind = OpenStatement::Kind::FUNCTION, .statement = statement, .scope = functionStatement->scope });
+
+                return {};
+
+            }
+
+            case TokenType::RETURN: {
+
+                auto returnStatement = allocator.allocate<Node::StatementVariant::Return>();
+
+                next();
+
+                returnStatement->expression = parseExpression();
+
+                statement->variant = returnStatement;
+
+                break;
+
+            }
+
+            case TokenType::OPEN_CURLY_BRACKET: {
+
+                next();
+
+                auto scope = allocator.allocate<Node::Scope>();
+
+                statement->variant = scope;
+
+                open.push_back({ .kind = OpenStatement::Kind::BLOCK, .statement = statement, .scope = scope });
+
+                return {};
+
+            }
+
+            default: raise("Failed to parse Expression! Unknown token", line(get()), column(get()));
+
+        }
+
+        if (get().type == TokenType::SEMICOLON) next();
+        else raise("Failed to parse Expression! ';' expected", line(get()));
+
+        return statement;
+
+    }
+
+    // Operator precedence parsing with explicit operand and operator stacks. Round brackets and calls
+    // are markers on the operator stack, binary operators above a marker belong to its inner expression.
+    struct PendingOperator {
+        enum class Kind { BINARY, BRACKETS, CALL } kind;
+        TokenType type {};                             // Operator of BINARY
+        Node::ExpressionVariant::Call* call = nullptr; // Call of CALL
+        size_t operandBase = 0;                        // Operands below belong to the enclosing expression
+    };
+
+    inline Node::Expression* parseExpression() {
+
+        vector<Node::Expression*> operands;
+        vector<PendingOperator> operators;
+
+        bool expectOperand = true;
+
+        while (true) {
+
+            if (expectOperand) {
+
+                if (get().type == TokenType::INTEGER) {
+
+                    auto integerExpression = allocator.allocate<Node::ExpressionVariant::Integer>();
+                    integerExpression->value = get();
+
+                    next();
+
+                    operands.push_back(wrap(integerExpression));
+                    expectOperand = false;
+
+                }
+                else if (get().type == TokenType::IDENTIFIER && hasNext(1) && peek().type == TokenType::OPEN_ROUND_BRACKET) {
+
+                    auto callExpression = allocator.allocate<Node::ExpressionVariant::Call>();
+                    callExpression->identifierToken = get();
+
+                    next();
+                    next();
+
+                    if (get().type == TokenType::CLOSED_ROUND_BRACKET) {
+                        next();
+                        operands.push_back(wrap(callExpression));
+                        expectOperand = false;
+                    } else {
+                        operators.push_back({ .kind = PendingOperator::Kind::CALL, .call = callExpression, .operandBase = operands.size() });
+                    }
+
+                }
+                else if (get().type == TokenType::IDENTIFIER) {
+
+                    auto identifierExpression = allocator.allocate<Node::ExpressionVariant::Identifier>();
+                    identifierExpression->value = get();
+
+                    next();
+
+                    operands.push_back(wrap(identifierExpression));
+                    expectOperand = false;
+
+                }
+                else if (get().type == TokenType::OPEN_ROUND_BRACKET) {
+
+                    next();
+
+                    operators.push_back({ .kind = PendingOperator::Kind::BRACKETS, .operandBase = operands.size() });
+
+                }
+                else raise("Failed to parse Expression! Unexpected Token", line(get()), column(get()));
+
+                continue;
+
+            }
+
+            TokenType operatorType = get().type;
+
+            if (auto precedence = getBinaryPrecedence(operatorType)) {
+
+                // All operators are left associative
+                while (!operators.empty() && operators.back().kind == PendingOperator::Kind::BINARY
+                       && getBinaryPrecedence(operators.back().type).value() >= precedence.value()) {
+                    reduce(operands, operators);
+                }
+
+                next();
+
+                operators.push_back({ .kind = PendingOperator::Kind::BINARY, .type = operatorType });
+                expectOperand = true;
+
+                continue;
+
+            }
+
+            while (!operators.empty() && operators.back().kind == PendingOperator::Kind::BINARY) {
+                reduce(operands, operators);
+            }
+
+            if (operators.empty()) break;
+
+            PendingOperator marker = operators.back();
+
+            if (marker.kind == PendingOperator::Kind::BRACKETS) {
+
+                if (operatorType != TokenType::CLOSED_ROUND_BRACKET) raise("Failed to parse Expression! ')' expected", line(get()));
+
+                next();
+                operators.pop_back();
+
+                auto roundBracketExpression = allocator.allocate<Node::ExpressionVariant::RoundBrackets>();
+                roundBracketExpression->expression = operands.back();
+                operands.back() = wrap(roundBracketExpression);
+
+            } else if (operatorType == TokenType::COMMA) {
+
+                next();
+                expectOperand = true;
+
+            } else if (operatorType == TokenType::CLOSED_ROUND_BRACKET) {
+
+                next();
+                operators.pop_back();
+
+                marker.call->arguments.assign(operands.begin() + (long) marker.operandBase, operands.end());
+                operands.resize(marker.operandBase);
+                operands.push_back(wrap(marker.call));
+
+            } else raise("Failed to parse Call! ',' or ')' expected", line(get()));
+
+        }
+
+        return operands.back();
+
+    }
+
+    // Combines the two topmost operands with the topmost operator
+    inline void reduce(vector<Node::Expression*>& operands, vector<PendingOperator>& operators) {
+
+        TokenType operatorType = operators.back().type;
+        operators.pop_back();
+
+        Node::Expression* right = operands.back();
+        operands.pop_back();
+        Node::Expression* left = operands.back();
+
+        auto term = allocator.allocate<Node::ExpressionVariant::Term>();
+
+        switch (operatorType) {
+            case TokenType::PLUS: {
+                auto additionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Addition>();
+                additionTerm->left = left;
+                additionTerm->right = right;
+                term->variant = additionTerm;
+                break;
+            }
+            case TokenType::MINUS: {
+                auto subtractionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Subtraction>();
+                subtractionTerm->left = left;
+                subtractionTerm->right = right;
+                term->variant = subtractionTerm;
+                break;
+            }
+            case TokenType::ASTERISK: {
+                auto multiplicationTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Multiplication>();
+                multiplicationTerm->left = left;
+                multiplicationTerm->right = right;
+                term->variant = multiplicationTerm;
+                break;
+            }
+            case TokenType::SLASH: {
+                auto divisionTerm = allocator.allocate<Node::ExpressionVariant::TermVariant::Division>();
+                divisionTerm->left = left;
+                divisionTerm->right = right;
+                term->variant = divisionTerm;
+                break;
+            }
+            default: raise("Failed to parse Therm! Unexpected Operator Type", line(get()), column(get()));
+        }
+
+        operands.back() = wrap(term);
+
+    }
+
+    template <typename T>
+    inline Node::Expression* wrap(T* node) {
+        auto expression = allocator.allocate<Node::Expression>();
+        expression->variant = node;
+        return expression;
+    }
+
+    // Allocation
+    ArenaAllocator allocator;
+
+    // Tokens
+    const vector<Token> tokens;
+    Source& source;
+    size_t pointer = 0;
+
+    inline Token peek(int ahead = 1) {
+        return tokens.at(pointer + ahead);
+    }
+
+    inline Token get() {
+
+        if (!hasNext()) {
+            cerr << "Unexpected End Exception! Tried to access value out of bounds!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        return tokens.at(pointer);
+    }
+
+    inline void next() {
+        pointer++;
+    }
+
+    [[nodiscard]] inline bool hasNext(int ahead = 0) const {
+        return pointer + ahead < tokens.size();
+    }
+
+    // Errors
+    [[nodiscard]] size_t line(const Token& token) const {
+        return source.locate(token).line;
+    }
+
+    [[nodiscard]] size_t column(const Token& token) const {
+        return source.locate(token).column;
+    }
+
+    static void raise(const string& message, size_t line, size_t column) {
+        cerr << message << " at " << line << ":" << column << "!" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    static void raise(const string& message, size_t line) {
+        cerr << message << " at line " << line << "!" << endl;
+        exit(EXIT_FAILURE);
+    }
+
 };
\ No newline at end of file
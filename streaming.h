@@ -0,0 +1,137 @@
+#pragma once
+
+#include <fstream>
+#include "tokenizer.h"
+#include "parser.h"
+#include "generator.h"
+
+// Compiles a program of any size with bounded memory. The source is read in blocks, lexed up to the last complete
+// line, and every run of complete top level statements is parsed, generated and written out before the next block
+// is read. Only the tokens of an unfinished statement and the Generator's variables and function signatures are
+// kept in between, the tree of a piece is freed with its Parser.
+class StreamingCompiler {
+
+public:
+    static constexpr size_t defaultBlockSize = 1024 * 1024; // 1 MB
+
+    inline StreamingCompiler(const string& inputPath, Generator& generator, size_t blockSize = defaultBlockSize):
+            input(inputPath, ios::in | ios::binary),
+            generator(generator),
+            blockSize(max<size_t>(blockSize, 1))
+    {
+        if (!input) {
+            cerr << "Failed to open '" << inputPath << "'!" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void compile(ostream& output) {
+
+        output << generator.generatePrologue();
+
+        bool done = false;
+
+        while (!done) {
+
+            size_t size = window.size();
+            window.resize(size + blockSize);
+            input.read(window.data() + size, blockSize);
+            window.resize(size + input.gcount());
+
+            done = !input;
+
+            // Tokens never span lines, only the last line may still be incomplete. Everything before the new block
+            // up to a newline is lexed already, so only the block has to be searched.
+            size_t lexEnd = window.size();
+            if (!done) {
+                size_t newline = string_view(window).substr(size).rfind('\n');
+                lexEnd = newline == string::npos ? lexed : size + newline + 1;
+            }
+
+            Source source(std::move(window), line, column);
+
+            vector<Token> lexedTokens = Tokenizer::tokenize(source, lexed, lexEnd, inComment);
+            tokens.insert(tokens.end(), lexedTokens.cbegin(), lexedTokens.cend());
+            lexed = lexEnd;
+
+            size_t complete = done ? tokens.size() : findComplete();
+
+            if (complete > 0) {
+                Parser parser(vector<Token>(tokens.cbegin(), tokens.cbegin() + (ptrdiff_t) complete), source);
+                output << generator.generatePiece(parser.parse());
+            }
+
+            // The window continues at the first token that is still needed
+            size_t cut = complete < tokens.size() ? tokens[complete].offset : lexed;
+
+            tokens.erase(tokens.begin(), tokens.begin() + (ptrdiff_t) complete);
+            for (Token& token : tokens) token.offset -= cut;
+            scanned -= complete;
+
+            window = std::move(source).release();
+            advance(cut);
+
+        }
+
+        output << generator.generateEpilogue();
+
+    }
+
+private:
+
+    // Returns the number of tokens that form complete top level statements. A statement ends with a ';' or a '}' at
+    // depth 0, unless an else follows, which may only be known once the next token is there.
+    size_t findComplete() {
+
+        for (; scanned < tokens.size(); scanned++) {
+
+            TokenType type = tokens[scanned].type;
+
+            if (ended && type != TokenType::ELSE) complete = scanned;
+            ended = false;
+
+            if (type == TokenType::OPEN_CURLY_BRACKET) depth++;
+            else if (type == TokenType::CLOSED_CURLY_BRACKET && depth > 0) ended = --depth == 0;
+            else if (type == TokenType::SEMICOLON) ended = depth == 0;
+
+        }
+
+        size_t result = complete;
+        complete = 0;
+        return result;
+
+    }
+
+    // Drops the first `bytes` of the window, keeping track of where it starts in the program
+    void advance(size_t bytes) {
+
+        size_t newlines = count(window.cbegin(), window.cbegin() + (ptrdiff_t) bytes, '\n');
+
+        if (newlines > 0) {
+            line += newlines;
+            column = bytes - window.rfind('\n', bytes - 1);
+        } else {
+            column += bytes;
+        }
+
+        window.erase(0, bytes);
+        lexed -= bytes;
+
+    }
+
+    ifstream input;
+    Generator& generator;
+    const size_t blockSize;
+
+    string window;              // Source text from the first unfinished statement on
+    size_t lexed = 0;           // End of the lexed part of the window
+    bool inComment = false;     // Whether the lexed part ends inside a block comment
+    size_t line = 1;            // Position of the window in the program
+    size_t column = 1;
+
+    vector<Token> tokens;       // Lexed but not compiled yet, relative to the window
+    size_t scanned = 0;         // Tokens already seen by findComplete
+    size_t depth = 0;
+    bool ended = false;         // The last scanned token ends a statement if no else follows
+    size_t complete = 0;
+};
@@ -0,0 +1,513 @@
+#pragma once
+
+#include <map>
+#include <bit>
+#include <array>
+#include <random>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include "parser.h"
+
+// Finds the shortest instruction sequence for small + - * expressions over at most three variables.
+// The search is slow and runs offline, its results are kept in a table keyed by the shape of the expression,
+// so regular compiles only look them up.
+class Superoptimizer {
+
+public:
+    // The variables of a shape are loaded into these registers in order of their first appearance,
+    // sequences leave the result in rax and may clobber rcx and rdx
+    static constexpr const char* inputRegisters[] = { "r8", "r9", "r10" };
+
+    struct Shape {
+        string key;                 // The expression with its variables renamed to v0, v1, ...
+        vector<string> variables;   // The name of each v<i>
+    };
+
+    inline explicit Superoptimizer(string tablePath, bool searching = false):
+            tablePath(std::move(tablePath))
+    {
+        load(searching);
+    }
+
+    // Only arithmetic terms without division are shapes, everything else is generated as usual
+    static optional<Shape> shape(const Node::Expression* expression, const Source& source) {
+
+        expression = unbracket(expression);
+        if (!holds_alternative<Node::ExpressionVariant::Term*>(expression->variant)) return nullopt;
+
+        Shape shape;
+        size_t budget = shapeLimit;
+        if (!describe(expression, source, shape, budget)) return nullopt;
+
+        return shape;
+
+    }
+
+    // The instructions for the shape, nullptr if the table has none
+    [[nodiscard]] const vector<string>* lookup(const string& key) const {
+        auto it = table.find(key);
+        return it == table.cend() || it->second.empty() ? nullptr : &it->second;
+    }
+
+    // Searches every shape of the program that isn't in the table yet
+    void search(Node::Program program) {
+
+        auto searchStatement = [&](const Node::Statement* statement) {
+            Node::forEachStatement(statement, [&](const Node::Statement* nested) {
+
+                const Node::Expression* expression = Node::evaluatedExpression(nested);
+                if (!expression) return;
+
+                Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+                    optional<Shape> found = shape(subexpression, *program.source);
+                    if (found && !table.contains(found->key)) table[found->key] = searchShape(subexpression, *program.source);
+                });
+
+            });
+        };
+
+        for (const Node::Statement* statement : program.scope->statements) {
+            searchStatement(statement);
+            if (auto function = get_if<Node::StatementVariant::Function*>(&statement->variant)) {
+                for (const Node::Statement* nested : (*function)->scope->statements) searchStatement(nested);
+            }
+        }
+
+    }
+
+    // One shape per line: the key, a tab and the instructions separated by "; ", nothing if there is no sequence
+    void save() const {
+
+        fstream file(tablePath, ios::out);
+
+        for (const auto& [key, instructions] : table) {
+            file << key << '\t';
+            for (size_t i = 0; i < instructions.size(); i++) file << (i > 0 ? "; " : "") << instructions[i];
+            file << '\n';
+        }
+
+        if (!file) {
+            cerr << "Failed to write superoptimizer table '" << tablePath << "'!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+private:
+
+    // Larger expressions are out of reach of the search anyway, this also bounds the recursion of describe
+    static constexpr size_t shapeLimit = 15;
+    static constexpr size_t maxVariables = size(inputRegisters);
+    static constexpr size_t maxLength = 3;
+
+    void load(bool searching) {
+
+        fstream file(tablePath, ios::in);
+
+        if (!file) {
+            if (!searching) cerr << "Warning: Failed to read superoptimizer table '" << tablePath << "', ignoring it!" << endl;
+            return;
+        }
+
+        string line;
+        while (getline(file, line)) {
+
+            size_t tab = line.find('\t');
+            if (tab == string::npos) continue;
+
+            vector<string> instructions;
+            for (size_t start = tab + 1; start < line.size();) {
+                size_t end = min(line.find("; ", start), line.size());
+                instructions.push_back(line.substr(start, end - start));
+                start = end + 2;
+            }
+
+            table[line.substr(0, tab)] = std::move(instructions);
+
+        }
+
+    }
+
+    static const Node::Expression* unbracket(const Node::Expression* expression) {
+        while (auto brackets = get_if<Node::ExpressionVariant::RoundBrackets*>(&expression->variant)) {
+            expression = (*brackets)->expression;
+        }
+        return expression;
+    }
+
+    static bool describe(const Node::Expression* expression, const Source& source, Shape& shape, size_t& budget) {
+
+        if (budget == 0) return false;
+        budget--;
+
+        expression = unbracket(expression);
+
+        if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&expression->variant)) {
+            // Literals that don't fit in 64 bits are left to the regular code generation
+            optional<uint64_t> value = source.integer((*integer)->value);
+            if (!value) return false;
+            shape.key += to_string(*value);
+            return true;
+        }
+
+        if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&expression->variant)) {
+
+            string name = source.value((*identifier)->value);
+            auto it = find(shape.variables.cbegin(), shape.variables.cend(), name);
+
+            if (it == shape.variables.cend()) {
+                if (shape.variables.size() == maxVariables) return false;
+                shape.variables.push_back(name);
+                it = shape.variables.cend() - 1;
+            }
+
+            shape.key += "v" + to_string(it - shape.variables.cbegin());
+            return true;
+
+        }
+
+        auto term = get_if<Node::ExpressionVariant::Term*>(&expression->variant);
+        if (!term || holds_alternative<Node::ExpressionVariant::TermVariant::Division*>((*term)->variant)) return false;
+
+        return visit([&](auto* binary) {
+
+            shape.key += "(";
+            if (!describe(binary->left, source, shape, budget)) return false;
+            shape.key += operatorOf(*term);
+            if (!describe(binary->right, source, shape, budget)) return false;
+            shape.key += ")";
+
+            return true;
+
+        }, (*term)->variant);
+
+    }
+
+    static char operatorOf(const Node::ExpressionVariant::Term* term) {
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Addition*>(term->variant)) return '+';
+        if (holds_alternative<Node::ExpressionVariant::TermVariant::Subtraction*>(term->variant)) return '-';
+        return '*';
+    }
+
+    // Polynomials over the variables with coefficients mod 2^64, every + - * expression has exactly one.
+    // Equal polynomials always compute the same values, which makes them the equivalence check of the search.
+
+    using Monomial = array<uint8_t, maxVariables>; // Exponent of each variable
+    using Polynomial = map<Monomial, uint64_t>;    // Without zero coefficients
+
+    static Polynomial constant(uint64_t value) {
+        Polynomial result;
+        if (value != 0) result[{}] = value;
+        return result;
+    }
+
+    static Polynomial variable(size_t index) {
+        Monomial monomial {};
+        monomial[index] = 1;
+        return { { monomial, 1 } };
+    }
+
+    static void accumulate(Polynomial& result, const Monomial& monomial, uint64_t coefficient) {
+        uint64_t& sum = result[monomial];
+        sum += coefficient;
+        if (sum == 0) result.erase(monomial);
+    }
+
+    static Polynomial add(const Polynomial& a, const Polynomial& b, uint64_t sign = 1) {
+        Polynomial result = a;
+        for (const auto& [monomial, coefficient] : b) accumulate(result, monomial, coefficient * sign);
+        return result;
+    }
+
+    static Polynomial multiply(const Polynomial& a, const Polynomial& b) {
+
+        Polynomial result;
+
+        for (const auto& [left, leftCoefficient] : a) {
+            for (const auto& [right, rightCoefficient] : b) {
+                Monomial monomial;
+                for (size_t i = 0; i < maxVariables; i++) monomial[i] = left[i] + right[i];
+                accumulate(result, monomial, leftCoefficient * rightCoefficient);
+            }
+        }
+
+        return result;
+
+    }
+
+    static Polynomial polynomial(const Node::Expression* expression, const Source& source, const vector<string>& variables) {
+
+        expression = unbracket(expression);
+
+        if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&expression->variant)) {
+            return constant(source.integer((*integer)->value).value());
+        }
+
+        if (auto identifier = get_if<Node::ExpressionVariant::Identifier*>(&expression->variant)) {
+            auto it = find(variables.cbegin(), variables.cend(), source.value((*identifier)->value));
+            return variable(it - variables.cbegin());
+        }
+
+        const Node::ExpressionVariant::Term* term = get<Node::ExpressionVariant::Term*>(expression->variant);
+
+        return visit([&](auto* binary) {
+
+            Polynomial left = polynomial(binary->left, source, variables);
+            Polynomial right = polynomial(binary->right, source, variables);
+
+            switch (operatorOf(term)) {
+                case '+': return add(left, right);
+                case '-': return add(left, right, -1);
+                default: return multiply(left, right);
+            }
+
+        }, term->variant);
+
+    }
+
+    // Search
+    // Sequences are enumerated by increasing length. A candidate has to match the expression on a few random inputs
+    // first, only then its polynomial is compared, so the exact check runs rarely.
+
+    static constexpr size_t registerCount = 6;
+    static constexpr size_t temporaries = 3;    // rax, rcx and rdx come first, then the inputs
+    static constexpr const char* registerNames[registerCount] = { "rax", "rcx", "rdx", "r8", "r9", "r10" };
+    static constexpr size_t tests = 8;
+
+    using Values = array<uint64_t, tests>;
+    using Registers = array<Values, registerCount>;
+
+    struct Instruction {
+
+        enum class Op { MOV, MOV_IMMEDIATE, ADD, SUB, IMUL, IMUL_IMMEDIATE, LEA, LEA_IMMEDIATE, SHL, NEG } op;
+        uint8_t target;
+        uint8_t source = 0;
+        uint8_t index = 0;
+        uint64_t immediate = 0;     // Constant, displacement, scale or shift count
+
+        // Registers the instruction reads
+        [[nodiscard]] unsigned reads() const {
+            switch (op) {
+                case Op::MOV_IMMEDIATE: return 0;
+                case Op::MOV: case Op::IMUL_IMMEDIATE: case Op::LEA_IMMEDIATE: return 1u << source;
+                case Op::LEA: return (1u << source) | (1u << index);
+                case Op::SHL: case Op::NEG: return 1u << target;
+                default: return (1u << target) | (1u << source);
+            }
+        }
+
+        [[nodiscard]] uint64_t apply(uint64_t target, uint64_t source, uint64_t index) const {
+            switch (op) {
+                case Op::MOV: return source;
+                case Op::MOV_IMMEDIATE: return immediate;
+                case Op::ADD: return target + source;
+                case Op::SUB: return target - source;
+                case Op::IMUL: return target * source;
+                case Op::IMUL_IMMEDIATE: return source * immediate;
+                case Op::LEA: return source + index * immediate;
+                case Op::LEA_IMMEDIATE: return source + immediate;
+                case Op::SHL: return target << immediate;
+                case Op::NEG: return -target;
+            }
+            return 0;
+        }
+
+        [[nodiscard]] Polynomial apply(const Polynomial& target, const Polynomial& source, const Polynomial& index) const {
+            switch (op) {
+                case Op::MOV: return source;
+                case Op::MOV_IMMEDIATE: return constant(immediate);
+                case Op::ADD: return add(target, source);
+                case Op::SUB: return add(target, source, -1);
+                case Op::IMUL: return multiply(target, source);
+                case Op::IMUL_IMMEDIATE: return multiply(source, constant(immediate));
+                case Op::LEA: return add(source, multiply(index, constant(immediate)));
+                case Op::LEA_IMMEDIATE: return add(source, constant(immediate));
+                case Op::SHL: return multiply(target, constant(uint64_t(1) << immediate));
+                case Op::NEG: return add({}, target, -1);
+            }
+            return {};
+        }
+
+        [[nodiscard]] string text() const {
+
+            string t = registerNames[target], s = registerNames[source], i = registerNames[index];
+            string value = to_string(int64_t(immediate));
+
+            switch (op) {
+                case Op::MOV: return "mov " + t + ", " + s;
+                case Op::MOV_IMMEDIATE: return "mov " + t + ", " + value;
+                case Op::ADD: return "add " + t + ", " + s;
+                case Op::SUB: return "sub " + t + ", " + s;
+                case Op::IMUL: return "imul " + t + ", " + s;
+                case Op::IMUL_IMMEDIATE: return "imul " + t + ", " + s + ", " + value;
+                case Op::LEA: return "lea " + t + ", [" + s + "+" + i + "*" + value + "]";
+                case Op::LEA_IMMEDIATE: return "lea " + t + ", [" + s + (int64_t(immediate) < 0 ? "" : "+") + value + "]";
+                case Op::SHL: return "shl " + t + ", " + value;
+                case Op::NEG: return "neg " + t;
+            }
+            return "";
+
+        }
+
+    };
+
+    static bool fitsImmediate(uint64_t value) {
+        return int64_t(value) >= INT32_MIN && int64_t(value) <= INT32_MAX;
+    }
+
+    // The constants of the expression and the coefficients of its polynomial, with their negations
+    static vector<Instruction> candidates(const Polynomial& target, const vector<uint64_t>& constants) {
+
+        vector<uint64_t> immediates;
+        auto addImmediate = [&](uint64_t value) {
+            for (uint64_t candidate : { value, -value }) {
+                if (candidate != 0 && find(immediates.cbegin(), immediates.cend(), candidate) == immediates.cend()) {
+                    immediates.push_back(candidate);
+                }
+            }
+        };
+
+        for (uint64_t value : constants) addImmediate(value);
+        for (const auto& [monomial, coefficient] : target) addImmediate(coefficient);
+
+        using Op = Instruction::Op;
+        vector<Instruction> result;
+
+        for (uint8_t t = 0; t < temporaries; t++) {
+
+            result.push_back({ .op = Op::NEG, .target = t });
+
+            for (uint8_t s = 0; s < registerCount; s++) {
+
+                if (s != t) result.push_back({ .op = Op::MOV, .target = t, .source = s });
+                for (Op op : { Op::ADD, Op::SUB, Op::IMUL }) result.push_back({ .op = op, .target = t, .source = s });
+
+                for (uint8_t i = 0; i < registerCount; i++) {
+                    for (uint64_t scale : { 1, 2, 4, 8 }) {
+                        if (scale == 1 && i < s) continue; // [s+i*1] is [i+s*1]
+                        result.push_back({ .op = Op::LEA, .target = t, .source = s, .index = i, .immediate = scale });
+                    }
+                }
+
+                for (uint64_t immediate : immediates) {
+                    if (!fitsImmediate(immediate)) continue;
+                    result.push_back({ .op = Op::IMUL_IMMEDIATE, .target = t, .source = s, .immediate = immediate });
+                    result.push_back({ .op = Op::LEA_IMMEDIATE, .target = t, .source = s, .immediate = immediate });
+                }
+
+            }
+
+            for (uint64_t immediate : immediates) {
+                result.push_back({ .op = Op::MOV_IMMEDIATE, .target = t, .immediate = immediate });
+                if (has_single_bit(immediate) && immediate > 1) {
+                    result.push_back({ .op = Op::SHL, .target = t, .immediate = uint64_t(countr_zero(immediate)) });
+                }
+            }
+
+        }
+
+        return result;
+
+    }
+
+    static vector<string> searchShape(const Node::Expression* expression, const Source& source) {
+
+        Shape found = shape(expression, source).value();
+        Polynomial target = polynomial(expression, source, found.variables);
+
+        vector<uint64_t> constants;
+        Node::forEachExpression(expression, [&](const Node::Expression* subexpression) {
+            if (auto integer = get_if<Node::ExpressionVariant::Integer*>(&subexpression->variant)) {
+                constants.push_back(source.integer((*integer)->value).value());
+            }
+        });
+
+        vector<Instruction> instructions = candidates(target, constants);
+
+        // Fixed seed, so the table doesn't depend on the run that filled it
+        mt19937_64 random(0x5eed);
+
+        Registers initial {};
+        unsigned defined = 0;
+
+        for (size_t i = 0; i < found.variables.size(); i++) {
+            for (uint64_t& value : initial[temporaries + i]) value = random();
+            defined |= 1u << (temporaries + i);
+        }
+
+        Values expected {};
+        for (size_t test = 0; test < tests; test++) {
+            for (const auto& [monomial, coefficient] : target) {
+                uint64_t term = coefficient;
+                for (size_t i = 0; i < maxVariables; i++) {
+                    for (uint8_t power = 0; power < monomial[i]; power++) term *= initial[temporaries + i][test];
+                }
+                expected[test] += term;
+            }
+        }
+
+        vector<const Instruction*> sequence;
+        vector<Registers> states { initial };
+
+        for (size_t length = 1; length <= maxLength; length++) {
+            if (searchSequence(instructions, length, defined, expected, target, sequence, states)) {
+                vector<string> result;
+                for (const Instruction* instruction : sequence) result.push_back(instruction->text());
+                return result;
+            }
+        }
+
+        return {};
+
+    }
+
+    static bool searchSequence(const vector<Instruction>& instructions, size_t length, unsigned defined, const Values& expected,
+                               const Polynomial& target, vector<const Instruction*>& sequence, vector<Registers>& states) {
+
+        bool last = sequence.size() + 1 == length;
+
+        for (const Instruction& instruction : instructions) {
+
+            if ((instruction.reads() & ~defined) != 0) continue;
+            if (last && instruction.target != 0) continue;
+
+            Registers next = states.back();
+            for (size_t test = 0; test < tests; test++) {
+                next[instruction.target][test] = instruction.apply(next[instruction.target][test], next[instruction.source][test], next[instruction.index][test]);
+            }
+
+            sequence.push_back(&instruction);
+
+            if (last) {
+                if (next[0] == expected && verify(sequence, target)) return true;
+            } else {
+                states.push_back(next);
+                if (searchSequence(instructions, length, defined | (1u << instruction.target), expected, target, sequence, states)) return true;
+                states.pop_back();
+            }
+
+            sequence.pop_back();
+
+        }
+
+        return false;
+
+    }
+
+    static bool verify(const vector<const Instruction*>& sequence, const Polynomial& target) {
+
+        array<Polynomial, registerCount> registers;
+        for (size_t i = 0; i < maxVariables; i++) registers[temporaries + i] = variable(i);
+
+        for (const Instruction* instruction : sequence) {
+            registers[instruction->target] = instruction->apply(registers[instruction->target], registers[instruction->source], registers[instruction->index]);
+        }
+
+        return registers[0] == target;
+
+    }
+
+    const string tablePath;
+    map<string, vector<string>> table {};   // Searched shapes, an empty sequence if there is none
+};
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Assembles and links the output of the compiler into an executable. Uses NASM when it is installed, otherwise the
+# NASM subset the Generator emits is rewritten for GNU as.
+#
+# Usage: tests/assemble.sh <assembly> <executable>
+
+assembly="${1:?Usage: $0 <assembly> <executable>}"
+executable="${2:?Usage: $0 <assembly> <executable>}"
+
+if command -v nasm > /dev/null; then
+    nasm -f elf64 "$assembly" -o "$executable.o" || exit 1
+else
+    sed -E \
+        -e '1i .intel_syntax noprefix' \
+        -e '/^%line /d' \
+        -e 's/^global /.globl /' \
+        -e 's/^section \.data$/.data/' \
+        -e 's/^section (\.text\.unlikely) .*align=([0-9]+)$/.section \1,"ax",@progbits\n.balign \2/' \
+        -e 's/\[rel /[rip + /' \
+        -e 's/\b(qword|QWORD) \[/QWORD PTR [/' \
+        -e 's/^( *)times ([0-9]+) dq 0$/\1.fill \2, 8, 0/' \
+        -e 's/^( *)dq /\1.quad /' \
+        -e 's/^( *)db /\1.byte /' \
+        -e '$a\' \
+        "$assembly" | as --64 -o "$executable.o" - || exit 1
+fi
+
+ld "$executable.o" -o "$executable" || exit 1
+rm -f "$executable.o"
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Every program has to exit with the same code when it is run from its source with --run
+# and when the module written by --emit-bytecode is mapped and run.
+#
+# Usage: tests/bytecode_roundtrip.sh <compiler> [programs...]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [programs...]}")"
+shift
+
+cd "$(dirname "$0")"
+programs=("$@")
+[ ${#programs[@]} -eq 0 ] && programs=(programs/*.n ../main.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+failures=0
+
+for program in "${programs[@]}"; do
+
+    module="$work/$(basename "$program" .n).nbc"
+
+    "$compiler" "$program" --run
+    expected=$?
+
+    if ! "$compiler" "$program" "--emit-bytecode=$module"; then
+        echo "FAIL $program: --emit-bytecode failed"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    "$compiler" "$module"
+    actual=$?
+
+    if [ "$actual" -ne "$expected" ]; then
+        echo "FAIL $program: --run exited with $expected, the mapped module with $actual"
+        failures=$((failures + 1))
+    else
+        echo "ok   $program ($expected)"
+    fi
+
+done
+
+exit $((failures > 0))
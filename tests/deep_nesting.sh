@@ -0,0 +1,98 @@
+#!/bin/bash
+# Deeply nested and very long inputs have to compile in time and without running out of stack: parentheses,
+# scopes, if chains, else if chains and flat + chains, each compiled to assembly (optimized and with -O0)
+# and run with --run, which has to exit with the expected code.
+#
+# Usage: tests/deep_nesting.sh <compiler> [depth] [seconds]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [depth] [seconds]}")"
+depth="${2:-1000000}"
+seconds="${3:-60}"
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+generate() {
+    awk -v n="$depth" -v shape="$1" 'BEGIN {
+        if (shape == "parentheses") {
+            printf "exit "
+            for (i = 0; i < n; i++) printf "("
+            printf "7"
+            for (i = 0; i < n; i++) printf ")"
+            print ";"
+        }
+        else if (shape == "scopes") {
+            print "let x = 0;"
+            for (i = 0; i < n; i++) print "{"
+            print "x = 5;"
+            for (i = 0; i < n; i++) print "}"
+            print "exit x;"
+        }
+        else if (shape == "ifs") {
+            print "let x = 1;"
+            for (i = 0; i < n; i++) print "if x {"
+            print "x = 9;"
+            for (i = 0; i < n; i++) print "}"
+            print "exit x;"
+        }
+        else if (shape == "elseifs") {
+            print "let x = 3;"
+            print "if x - 3 { x = 1; }"
+            for (i = 0; i < n; i++) print "else if x - 3 { x = 1; }"
+            print "else { x = 4; }"
+            print "exit x;"
+        }
+        else if (shape == "sums") {
+            printf "exit 1"
+            for (i = 1; i < n; i++) printf " + 1"
+            print ";"
+        }
+    }' > "$work/$1.n"
+}
+
+failures=0
+
+check() {
+    local name="$1" expected="$2"
+    shift 2
+
+    local start end status
+    start=$(date +%s%N)
+    timeout "$seconds" "$compiler" "$work/$name.n" "$@" > /dev/null
+    status=$?
+    end=$(date +%s%N)
+
+    local milliseconds=$(((end - start) / 1000000))
+
+    if [ "$status" -ne "$expected" ]; then
+        [ "$status" -eq 124 ] && echo "FAIL $name $*: timed out after ${seconds}s" \
+                              || echo "FAIL $name $*: exited with $status instead of $expected"
+        failures=$((failures + 1))
+    else
+        echo "ok   $name $* (${milliseconds} ms)"
+    fi
+}
+
+for shape in parentheses scopes ifs elseifs sums; do
+
+    generate "$shape"
+
+    case "$shape" in
+        parentheses) expected=7 ;;
+        scopes) expected=5 ;;
+        ifs) expected=9 ;;
+        elseifs) expected=4 ;;
+        sums) expected=$((depth % 256)) ;;
+    esac
+
+    check "$shape" 0
+    check "$shape" 0 -O0
+    check "$shape" "$expected" --run
+
+done
+
+exit $((failures > 0))
@@ -0,0 +1,59 @@
+#!/bin/bash
+# The optimizer must not hide errors: every invalid program has to be rejected with the same message and exit code
+# when it is compiled with -O0, compiled with the optimizer and run with --run.
+#
+# Usage: tests/diagnostics.sh <compiler> [programs...]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [programs...]}")"
+shift
+
+programs=()
+for program in "$@"; do programs+=("$(realpath "$program")"); done
+
+cd "$(dirname "$0")"
+[ ${#programs[@]} -eq 0 ] && programs=("$PWD"/errors/*.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+failures=0
+
+for program in "${programs[@]}"; do
+
+    name="$(basename "$program")"
+
+    "$compiler" "$program" -O0 > /dev/null 2> "$work/expected"
+    expected=$?
+
+    if [ "$expected" -eq 0 ]; then
+        echo "FAIL $name: -O0 accepted the program"
+        failures=$((failures + 1))
+        continue
+    fi
+
+    failed=false
+
+    for options in "" "--run"; do
+
+        "$compiler" "$program" $options > /dev/null 2> "$work/actual"
+        actual=$?
+
+        if [ "$actual" -ne "$expected" ] || ! cmp -s "$work/expected" "$work/actual"; then
+            echo "FAIL $name ${options:-(optimized)}: exited with $actual, expected $expected from -O0"
+            diff "$work/expected" "$work/actual"
+            failed=true
+        fi
+
+    done
+
+    if $failed; then failures=$((failures + 1))
+    else echo "ok   $name: $(head -1 "$work/expected")"
+    fi
+
+done
+
+exit $((failures > 0))
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Parallel generation: every program has to compile to exactly the assembly of -j1 with any number of jobs, with and
+# without the optimizer and vectorized. Next to tests/programs a program is generated whose top level interleaves
+# lets with scopes and ifs, which become tasks that read, assign and declare variables of all ages and call
+# functions. Invalid programs have to be rejected with the message of -j1.
+#
+# Usage: tests/parallel.sh <compiler> [programs...]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [programs...]}")"
+shift
+
+programs=()
+for program in "$@"; do programs+=("$(realpath "$program")"); done
+
+cd "$(dirname "$0")"
+[ ${#programs[@]} -eq 0 ] && programs=("$PWD"/programs/*.n)
+errors=("$PWD"/errors/*.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+[ $# -eq 0 ] && awk 'BEGIN {
+    print "fn twice(x) { return x * 2; }"
+    print "fn count(n) { if n { return count(n - 1) + 1; } return 0; }"
+    for (i = 0; i < 200; i++) {
+        printf "let v%d = %d;\n", i, i
+        j = int(i / 2); k = int(i / 3)
+        if (i % 3 == 0) printf "{ let t = v%d + v%d; v%d = twice(t) - v%d; }\n", i, j, k, i
+        else if (i % 3 == 1) printf "if v%d - %d { v%d = count(v%d); } else { let v%d = 1; v%d = v%d * 3; }\n", j, j, i, k, i + 1, j, j
+        else printf "if v%d { { let u = v%d; let w = u + v%d; v%d = w; } }\n", k, i, j, k
+    }
+    print "exit v199 + v0;"
+}' > "$work/tasks.n" && programs+=("$work/tasks.n")
+
+failures=0
+
+fail() {
+    echo "FAIL $name: $1"
+    failures=$((failures + 1))
+}
+
+for program in "${programs[@]}"; do
+
+    name="$(basename "$program")"
+    failed=false
+
+    for options in "" -O0 -msse2 -mavx2; do
+
+        "$compiler" "$program" -j1 $options > /dev/null || { fail "-j1${options:+ $options} build failed"; failed=true; break; }
+        cp ../out.asm "$work/sequential.asm"
+
+        for jobs in 2 4 16; do
+            "$compiler" "$program" "-j$jobs" $options > /dev/null || { fail "-j$jobs${options:+ $options} build failed"; failed=true; break 2; }
+            cmp -s ../out.asm "$work/sequential.asm" || { fail "-j$jobs${options:+ $options} differs from -j1"; failed=true; break 2; }
+        done
+
+    done
+
+    $failed || echo "ok   $name"
+
+done
+
+for program in "${errors[@]}"; do
+
+    name="$(basename "$program")"
+
+    "$compiler" "$program" -j1 > /dev/null 2> "$work/expected" && { fail "-j1 accepted the program"; continue; }
+
+    for jobs in 2 4 16; do
+        "$compiler" "$program" "-j$jobs" > /dev/null 2> "$work/actual"
+        cmp -s "$work/expected" "$work/actual" || { fail "-j$jobs reports $(head -1 "$work/actual")"; continue 2; }
+    done
+
+    echo "ok   $name: $(head -1 "$work/expected")"
+
+done
+
+exit $((failures > 0))
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Profile guided layout round trip: every program in tests/profiles is built with -fprofile-generate and run to
+# write its profile, then rebuilt with -fprofile-use. The program's name is the layout its kernel if has to get,
+# and all builds have to exit with the same code as the -O0 build.
+#   cold_then   inverted condition, then branch out of line
+#   cold_else   else branch out of line
+#   inverted    inverted condition, else falls through
+# The recursion driving the kernel keeps the fall through layout.
+#
+# Usage: tests/profile_layout.sh <compiler>
+
+compiler="$(realpath "${1:?Usage: $0 <compiler>}")"
+
+cd "$(dirname "$0")"
+assemble="$PWD/assemble.sh"
+programs=("$PWD"/profiles/*.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+failures=0
+
+# Builds and runs the program with the given options, prints the exit code
+native() {
+    local program="$1"
+    shift
+    "$compiler" "$program" "$@" > /dev/null || return 1
+    "$assemble" ../out.asm "$work/program" || return 1
+    "$work/program"
+    echo $?
+}
+
+fail() {
+    echo "FAIL $name: $1"
+    failures=$((failures + 1))
+}
+
+for program in "${programs[@]}"; do
+
+    name="$(basename "$program" .n)"
+    profile="$work/$name.profile"
+
+    expected="$(native "$program" -O0)" || { fail "-O0 build failed"; continue; }
+
+    generated="$(native "$program" "-fprofile-generate=$profile")" || { fail "instrumented build failed"; continue; }
+    [ "$generated" -eq "$expected" ] || { fail "instrumented build exited with $generated, -O0 with $expected"; continue; }
+    [ -s "$profile" ] || { fail "no profile written"; continue; }
+
+    used="$(native "$program" "-fprofile-use=$profile")" || { fail "-fprofile-use build failed"; continue; }
+    [ "$used" -eq "$expected" ] || { fail "-fprofile-use build exited with $used, -O0 with $expected"; continue; }
+
+    # Only COLD_THEN and INVERTED branch on a true condition, only the cold layouts fill .text.unlikely
+    inverted=$(grep -c '^    jnz ' ../out.asm)
+    cold=$(grep -c '^section \.text\.unlikely' ../out.asm)
+
+    case "$name" in
+        cold_then) [ "$inverted" -eq 1 ] && [ "$cold" -eq 1 ] ;;
+        cold_else) [ "$inverted" -eq 0 ] && [ "$cold" -eq 1 ] ;;
+        inverted) [ "$inverted" -eq 1 ] && [ "$cold" -eq 0 ] ;;
+        *) true ;;
+    esac || { fail "not laid out as $name (inverted ifs: $inverted, cold section: $cold)"; continue; }
+
+    echo "ok   $name ($expected)"
+
+done
+
+exit $((failures > 0))
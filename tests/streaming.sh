@@ -0,0 +1,91 @@
+#!/bin/bash
+# Streaming compilation: every program is compiled with --stream, once with the default block size and once for each
+# of the small block sizes that split its statements across many blocks. Programs without functions have to produce
+# exactly the assembly of -O0. Streamed functions are emitted after the piece they arrive in and jumped over, where
+# depends on the block size, so programs with them have to exit with the same code as the -O0 build instead.
+# Errors have to be reported like -O0 reports them: the programs in tests/errors as they are, and every program with
+# a syntax error inserted around its middle line, which has to be the line in the message.
+#
+# Usage: tests/streaming.sh <compiler> [programs...]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [programs...]}")"
+shift
+
+programs=()
+for program in "$@"; do programs+=("$(realpath "$program")"); done
+
+cd "$(dirname "$0")"
+assemble="$PWD/assemble.sh"
+[ ${#programs[@]} -eq 0 ] && programs=("$PWD"/programs/*.n)
+errors=("$PWD"/errors/*.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+blockSizes=("" =1 =7 =64)
+failures=0
+
+# Builds and runs the program with the given options, prints the exit code
+native() {
+    local program="$1"
+    shift
+    "$compiler" "$program" "$@" > /dev/null || return 1
+    "$assemble" ../out.asm "$work/program" || return 1
+    "$work/program"
+    echo $?
+}
+
+fail() {
+    echo "FAIL $name: $1"
+    failures=$((failures + 1))
+}
+
+# Compiles the program with -O0 and streamed with every block size, all of them have to fail with the same message
+sameErrors() {
+    "$compiler" "$1" -O0 > /dev/null 2> "$work/expected" && { fail "-O0 accepted the program"; return 1; }
+    for blockSize in "${blockSizes[@]}"; do
+        "$compiler" "$1" -O0 "--stream$blockSize" > /dev/null 2> "$work/actual" && { fail "--stream$blockSize accepted the program"; return 1; }
+        cmp -s "$work/expected" "$work/actual" || { fail "--stream$blockSize reports $(head -1 "$work/actual")"; return 1; }
+    done
+}
+
+for program in "${programs[@]}"; do
+
+    name="$(basename "$program")"
+
+    expected="$(native "$program" -O0)" || { fail "-O0 build failed"; continue; }
+    cp ../out.asm "$work/unstreamed.asm"
+
+    for blockSize in "${blockSizes[@]}"; do
+        if grep -q '^fn ' "$program"; then
+            streamed="$(native "$program" -O0 "--stream$blockSize")" || { fail "--stream$blockSize build failed"; continue 2; }
+            [ "$streamed" -eq "$expected" ] || { fail "--stream$blockSize build exited with $streamed, -O0 with $expected"; continue 2; }
+        else
+            "$compiler" "$program" -O0 "--stream$blockSize" > /dev/null || { fail "--stream$blockSize build failed"; continue 2; }
+            cmp -s ../out.asm "$work/unstreamed.asm" || { fail "--stream$blockSize and -O0 differ"; continue 2; }
+        fi
+    done
+
+    # Inserted after the first line from the middle on that ends a statement or block, so it isn't commented out
+    line=$(awk -v middle=$((($(wc -l < "$program") + 1) / 2)) 'NR > middle && ended { print NR; exit } { ended = /[;{}] *$/ }' "$program")
+    [ -n "$line" ] || { fail "no line to break after the middle"; continue; }
+    awk -v line="$line" 'NR == line { print "let broken 1;" } { print }' "$program" > "$work/broken.n"
+    sameErrors "$work/broken.n" || continue
+    grep -q " at line $line!" "$work/expected" || { fail "the syntax error isn't reported at line $line: $(head -1 "$work/expected")"; continue; }
+
+    echo "ok   $name ($expected)"
+
+done
+
+for program in "${errors[@]}"; do
+
+    name="$(basename "$program")"
+    sameErrors "$program" && echo "ok   $name: $(head -1 "$work/expected")"
+
+done
+
+exit $((failures > 0))
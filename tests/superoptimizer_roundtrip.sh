@@ -0,0 +1,76 @@
+#!/bin/bash
+# Superoptimizer table round trip: --superoptimize searches the terms of every program and saves them to a table,
+# --superopt-table only looks them up from the saved table. Both have to produce the same assembly, and the native
+# programs have to exit with the same code as the -O0 build and as --run. At least one program has to actually be
+# changed by the table.
+#
+# Usage: tests/superoptimizer_roundtrip.sh <compiler> [programs...]
+
+compiler="$(realpath "${1:?Usage: $0 <compiler> [programs...]}")"
+shift
+
+programs=()
+for program in "$@"; do programs+=("$(realpath "$program")"); done
+
+cd "$(dirname "$0")"
+assemble="$PWD/assemble.sh"
+[ ${#programs[@]} -eq 0 ] && programs=("$PWD"/programs/*.n)
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+# The compiler writes its assembly to ../out.asm
+mkdir "$work/build"
+cd "$work/build"
+
+table="$work/table"
+failures=0
+changed=0
+
+# Builds and runs the program with the given options, prints the exit code
+native() {
+    local program="$1"
+    shift
+    "$compiler" "$program" "$@" > /dev/null || return 1
+    "$assemble" ../out.asm "$work/program" || return 1
+    "$work/program"
+    echo $?
+}
+
+fail() {
+    echo "FAIL $name: $1"
+    failures=$((failures + 1))
+}
+
+for program in "${programs[@]}"; do
+
+    name="$(basename "$program")"
+
+    expected="$(native "$program" -O0)" || { fail "-O0 build failed"; continue; }
+    "$compiler" "$program" --run
+    run=$?
+    [ "$run" -eq "$expected" ] || { fail "--run exited with $run, -O0 with $expected"; continue; }
+
+    "$compiler" "$program" > /dev/null || { fail "build failed"; continue; }
+    cp ../out.asm "$work/plain.asm"
+
+    searched="$(native "$program" "--superoptimize=$table")" || { fail "--superoptimize build failed"; continue; }
+    cp ../out.asm "$work/searched.asm"
+    [ "$searched" -eq "$expected" ] || { fail "--superoptimize build exited with $searched, -O0 with $expected"; continue; }
+
+    looked="$(native "$program" "--superopt-table=$table")" || { fail "--superopt-table build failed"; continue; }
+    [ "$looked" -eq "$expected" ] || { fail "--superopt-table build exited with $looked, -O0 with $expected"; continue; }
+    cmp -s ../out.asm "$work/searched.asm" || { fail "--superopt-table and --superoptimize differ"; continue; }
+
+    cmp -s ../out.asm "$work/plain.asm" || changed=$((changed + 1))
+
+    echo "ok   $name ($expected)"
+
+done
+
+if [ "$changed" -eq 0 ]; then
+    echo "FAIL the table changed none of the programs"
+    failures=$((failures + 1))
+fi
+
+exit $((failures > 0))
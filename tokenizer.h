@@ -1,212 +1,405 @@
-#pragma once
-
-enum class TokenType {
-    EXIT,
-
-    IF,
-    ELSE,
-
-    LET,
-    IDENTIFIER,
-    EQUALS,
-
-    INTEGER,
-
-    PLUS,
-    MINUS,
-    ASTERISK,
-    SLASH,
-
-    OPEN_ROUND_BRACKET,
-    CLOSED_ROUND_BRACKET,
-
-    OPEN_CURLY_BRACKET,
-    CLOSED_CURLY_BRACKET,
-
-    SEMICOLON
-};
-
-optional<int> getBinaryPrecedence (TokenType type) {
-
-    switch (type) {
-        case TokenType::PLUS: return 1;
-        case TokenType::MINUS: return 1;
-        case TokenType::ASTERISK: return 2;
-        case TokenType::SLASH: return 2;
-        default: return {};
-    }
-
-}
-
-struct Token {
-    TokenType type;
-    size_t line;
-    size_t column;
-    optional<string> value;
-};
-
-class Tokenizer {
-
-public:
-
-    inline explicit Tokenizer(string source)
-        : source(std::move(source)) {}
-
-    inline vector<Token> tokenize() {
-
-        string buffer;
-
-        while (hasNext()) {
-
-
-
-            if (isspace(get())) {
-                next();
-            }
-
-            else if (isalpha(get())) {
-
-                while (hasNext() && isalnum(get())) {
-                    buffer.push_back(get());
-                    next();
-                }
-
-                if (buffer == "exit") append( TokenType::EXIT );
-                else if (buffer == "let") append( TokenType::LET );
-                else if (buffer == "if") append( TokenType::IF );
-                else if (buffer == "else") append( TokenType::ELSE );
-                else append(TokenType::IDENTIFIER, buffer );
-
-            }
-
-            else if (isdigit(get())) {
-
-                while (hasNext() && isdigit(get())) {
-                    buffer.push_back(get());
-                    next();
-                }
-
-                append(TokenType::INTEGER, buffer);
-
-            }
-
-            else if (get() == '/' && peak(1) == '/') {
-                next(); next();
-                while (hasNext() && get() != '\n') {
-                    next();
-                }
-            }
-
-            else if (get() == '/' && peak(1) == '*') {
-                next();
-                next();
-                while (hasNext() && !(get() == '*' && peak(1) == '/')) {
-                    next();
-                }
-                if (hasNext()) next();
-                if (hasNext()) next();
-            }
-
-            else if (get() == ';') {
-                append(TokenType::SEMICOLON);
-                next();
-            }
-
-            else if (get() == '=') {
-                append(TokenType::EQUALS);
-                next();
-            }
-
-            else if (get() == '+') {
-                append(TokenType::PLUS);
-                next();
-            }
-
-            else if (get() == '-') {
-                append(TokenType::MINUS);
-                next();
-            }
-
-            else if (get() == '*') {
-                append(TokenType::ASTERISK);
-                next();
-            }
-
-            else if (get() == '/') {
-                append(TokenType::SLASH);
-                next();
-            }
-
-            else if (get() == '(') {
-                append(TokenType::OPEN_ROUND_BRACKET);
-                next();
-            }
-
-            else if (get() == ')') {
-                append(TokenType::CLOSED_ROUND_BRACKET);
-                next();
-            }
-
-            else if (get() == '{') {
-                append(TokenType::OPEN_CURLY_BRACKET);
-                next();
-            }
-
-            else if (get() == '}') {
-                append(TokenType::CLOSED_CURLY_BRACKET);
-                next();
-            }
-
-            buffer.clear();
-
-        }
-
-        return tokens;
-
-    }
-
-private:
-
-    const string source;
-    size_t pointer = 0;
-
-    size_t line = 1;
-    size_t column = 1;
-
-    vector<Token> tokens;
-
-    void append(TokenType type) {
-        Token token { type, line, column };
-        tokens.push_back(token);
-    }
-    
-    void append(TokenType type, string value) {
-        Token token { type, line, column, value };
-        tokens.push_back(token);
-    }
-
-    [[nodiscard]] char peak(int count) const {
-        return source.at(pointer + count);
-    }
-
-    [[nodiscard]] char get() const {
-        return source.at(pointer);
-    }
-
-    void next() {
-
-        pointer++;
-
-        if (hasNext() && get() == '\n') {
-            line++;
-            column = 0;
-        }
-
-        column++;
-    }
-
-    [[nodiscard]] bool hasNext() const {
-        return pointer < source.length();
-    }
-
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <charconv>
+#include <optional>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+enum class TokenType {
+    EXIT,
+
+    IF,
+    ELSE,
+
+    FN,
+    RETURN,
+
+    LET,
+    IDENTIFIER,
+    EQUALS,
+
+    INTEGER,
+
+    PLUS,
+    MINUS,
+    ASTERISK,
+    SLASH,
+
+    OPEN_ROUND_BRACKET,
+    CLOSED_ROUND_BRACKET,
+
+    OPEN_CURLY_BRACKET,
+    CLOSED_CURLY_BRACKET,
+
+    COMMA,
+    SEMICOLON
+};
+
+optional<int> getBinaryPrecedence (TokenType type) {
+
+    switch (type) {
+        case TokenType::PLUS: return 1;
+        case TokenType::MINUS: return 1;
+        case TokenType::ASTERISK: return 2;
+        case TokenType::SLASH: return 2;
+        default: return {};
+    }
+
+}
+
+// A token is a typed slice of the Source, its text and position are looked up there when needed
+struct Token {
+    TokenType type;
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct Location {
+    size_t line;
+    size_t column;
+};
+
+class Source {
+
+public:
+
+    inline explicit Source(string text, size_t firstLine = 1, size_t firstColumn = 1)
+        : text(std::move(text)), length(this->text.size()), lineBase(firstLine - 1), columnBase(firstColumn - 1) {
+
+        if (length > UINT32_MAX) {
+            cerr << "Source files larger than 4 GB are not supported!" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+    }
+
+    [[nodiscard]] const string& content() const {
+        return text;
+    }
+
+    // Hands the text back, for windows of a streamed program that are reused for the next one
+    [[nodiscard]] string release() && {
+        return std::move(text);
+    }
+
+    [[nodiscard]] string_view view(const Token& token) const {
+        return string_view(text).substr(token.offset, token.length);
+    }
+
+    [[nodiscard]] string value(const Token& token) const {
+        return string(view(token));
+    }
+
+    // Value of an integer literal, empty if it doesn't fit in 64 bits
+    [[nodiscard]] optional<uint64_t> integer(const Token& token) const {
+
+        string_view digits = view(token);
+
+        uint64_t value = 0;
+        auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), value);
+        if (error != errc() || end != digits.data() + digits.size()) return nullopt;
+
+        return value;
+
+    }
+
+    // Line and column are only needed for diagnostics, so the line index is built on first use
+    [[nodiscard]] Location locate(const Token& token) const {
+
+        // Parallel code generation may ask for locations from several threads
+        call_once(indexed, [&]() {
+            lineStarts.push_back(0);
+            for (size_t i = 0; i < length; i++) {
+                if (text[i] == '\n') lineStarts.push_back(i + 1);
+            }
+        });
+
+        size_t offset = min<size_t>(token.offset, length);
+        size_t line = upper_bound(lineStarts.cbegin(), lineStarts.cend(), offset) - lineStarts.cbegin();
+
+        size_t column = offset - lineStarts[line - 1] + 1;
+
+        return { .line = lineBase + line, .column = line == 1 ? columnBase + column : column };
+
+    }
+
+    // Appends text after the program, for names of variables the compiler introduces
+    Token synthesize(TokenType type, const string& value) {
+
+        Token token { type, (uint32_t) text.size(), (uint32_t) value.size() };
+        text += value;
+
+        return token;
+
+    }
+
+private:
+
+    string text;
+    const size_t length; // Of the program, synthesized text follows it
+
+    // Where the text starts in the program, when it is only a window of it
+    const size_t lineBase;
+    const size_t columnBase;
+
+    mutable vector<size_t> lineStarts;
+    mutable once_flag indexed;
+
+};
+
+class Tokenizer {
+
+public:
+
+    inline explicit Tokenizer(const Source& source)
+        : source(source.content()), end(source.content().size()) {}
+
+    inline vector<Token> tokenize() {
+
+        // A chunk may start inside a block comment, see tokenize(jobs)
+        if (inComment) skipComment();
+
+        while (hasNext()) {
+
+            size_t start = pointer;
+
+            if (isspace(get())) {
+                next();
+            }
+
+            else if (isalpha(get())) {
+
+                while (hasNext() && isalnum(get())) {
+                    next();
+                }
+
+                string_view word = string_view(source).substr(start, pointer - start);
+
+                if (word == "exit") append( TokenType::EXIT, start );
+                else if (word == "let") append( TokenType::LET, start );
+                else if (word == "if") append( TokenType::IF, start );
+                else if (word == "else") append( TokenType::ELSE, start );
+                else if (word == "fn") append( TokenType::FN, start );
+                else if (word == "return") append( TokenType::RETURN, start );
+                else append(TokenType::IDENTIFIER, start );
+
+            }
+
+            else if (isdigit(get())) {
+
+                while (hasNext() && isdigit(get())) {
+                    next();
+                }
+
+                append(TokenType::INTEGER, start);
+
+            }
+
+            else if (get() == '/' && peak(1) == '/') {
+                next(); next();
+                while (hasNext() && get() != '\n') {
+                    next();
+                }
+            }
+
+            else if (get() == '/' && peak(1) == '*') {
+                next();
+                next();
+                skipComment();
+            }
+
+            else if (get() == ',') {
+                append(TokenType::COMMA);
+                next();
+            }
+
+            else if (get() == ';') {
+                append(TokenType::SEMICOLON);
+                next();
+            }
+
+            else if (get() == '=') {
+                append(TokenType::EQUALS);
+                next();
+            }
+
+            else if (get() == '+') {
+                append(TokenType::PLUS);
+                next();
+            }
+
+            else if (get() == '-') {
+                append(TokenType::MINUS);
+                next();
+            }
+
+            else if (get() == '*') {
+                append(TokenType::ASTERISK);
+                next();
+            }
+
+            else if (get() == '/') {
+                append(TokenType::SLASH);
+                next();
+            }
+
+            else if (get() == '(') {
+                append(TokenType::OPEN_ROUND_BRACKET);
+                next();
+            }
+
+            else if (get() == ')') {
+                append(TokenType::CLOSED_ROUND_BRACKET);
+                next();
+            }
+
+            else if (get() == '{') {
+                append(TokenType::OPEN_CURLY_BRACKET);
+                next();
+            }
+
+            else if (get() == '}') {
+                append(TokenType::CLOSED_CURLY_BRACKET);
+                next();
+            }
+
+        }
+
+        return tokens;
+
+    }
+
+    // Lexes the range [begin, end) of the source, `inComment` carries an unterminated block comment over to the next range
+    inline static vector<Token> tokenize(const Source& source, size_t begin, size_t end, bool& inComment) {
+
+        Tokenizer tokenizer(source.content(), begin, end, inComment);
+        vector<Token> rangeTokens = tokenizer.tokenize();
+        inComment = tokenizer.inComment;
+
+        return rangeTokens;
+
+    }
+
+    // Lexes chunks of the source on up to `jobs` threads, the tokens are identical to the ones of tokenize()
+    inline vector<Token> tokenize(size_t jobs) {
+
+        size_t chunkCount = min(jobs, end / minimumChunk);
+        if (chunkCount < 2) return tokenize();
+
+        // Chunks end after a newline, so only block comments can continue into the next one
+        vector<size_t> bounds { 0 };
+
+        for (size_t i = 1; i < chunkCount; i++) {
+            size_t newline = source.find('\n', max(bounds.back(), end * i / chunkCount));
+            if (newline == string::npos || newline + 1 >= end) break;
+            bounds.push_back(newline + 1);
+        }
+
+        bounds.push_back(end);
+
+        vector<Chunk> chunks(bounds.size() - 1);
+
+        // Every chunk is lexed speculatively, assuming that it doesn't start inside a comment
+        atomic<size_t> nextChunk = 0;
+        vector<thread> workers;
+
+        for (size_t worker = 0; worker < min(jobs, chunks.size()); worker++) {
+            workers.emplace_back([&]() {
+                for (size_t index = nextChunk++; index < chunks.size(); index = nextChunk++) {
+                    chunks[index] = lexChunk(bounds[index], bounds[index + 1], false);
+                }
+            });
+        }
+
+        for (thread& worker : workers) worker.join();
+
+        // Fix-up pass: the chunks following an unterminated comment are lexed again from inside the comment
+        for (size_t index = 1; index < chunks.size(); index++) {
+            if (chunks[index - 1].endsInComment) chunks[index] = lexChunk(bounds[index], bounds[index + 1], true);
+        }
+
+        // Offsets are absolute, so the token arrays only have to be joined
+        size_t count = 0;
+        for (const Chunk& chunk : chunks) count += chunk.tokens.size();
+
+        tokens.reserve(count);
+        for (const Chunk& chunk : chunks) tokens.insert(tokens.end(), chunk.tokens.cbegin(), chunk.tokens.cend());
+
+        return tokens;
+
+    }
+
+private:
+
+    // Smaller sources aren't worth the threads
+    static constexpr size_t minimumChunk = 1024 * 1024; // 1 MB
+
+    struct Chunk {
+        vector<Token> tokens;
+        bool endsInComment = false;
+    };
+
+    inline Tokenizer(const string& source, size_t begin, size_t end, bool inComment)
+        : source(source), pointer(begin), end(end), inComment(inComment) {}
+
+    [[nodiscard]] Chunk lexChunk(size_t begin, size_t chunkEnd, bool startsInComment) const {
+
+        Tokenizer tokenizer(source, begin, chunkEnd, startsInComment);
+        vector<Token> chunkTokens = tokenizer.tokenize();
+
+        return { .tokens = std::move(chunkTokens), .endsInComment = tokenizer.inComment };
+
+    }
+
+    const string& source;
+    size_t pointer = 0;
+    size_t end;             // Of the range to lex
+    bool inComment = false; // Whether the range ended inside a block comment
+
+    vector<Token> tokens;
+
+    // Skips the rest of a block comment, which may continue past the end of the range
+    void skipComment() {
+
+        while (hasNext() && !(get() == '*' && peak(1) == '/')) {
+            next();
+        }
+
+        inComment = !hasNext();
+
+        if (hasNext()) next();
+        if (hasNext()) next();
+
+    }
+
+    // Single character token at the current position
+    void append(TokenType type) {
+        tokens.push_back({ type, (uint32_t) pointer, 1 });
+    }
+
+    // Token from `start` up to the current position
+    void append(TokenType type, size_t start) {
+        tokens.push_back({ type, (uint32_t) start, (uint32_t) (pointer - start) });
+    }
+
+    [[nodiscard]] char peak(int count) const {
+        return pointer + count < end ? source[pointer + count] : '\0';
+    }
+
+    [[nodiscard]] char get() const {
+        return source[pointer];
+    }
+
+    void next() {
+        pointer++;
+    }
+
+    [[nodiscard]] bool hasNext() const {
+        return pointer < end;
+    }
+
 };
\ No newline at end of file
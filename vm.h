@@ -0,0 +1,166 @@
+#pragma once
+
+#include "bytecode.h"
+
+// Threaded code needs the labels as values extension
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// Executes bytecode directly, as a quick alternative to assembling and linking the Generator output
+class VirtualMachine {
+
+public:
+    inline explicit VirtualMachine(Bytecode bytecode):
+            bytecode(bytecode)
+    {}
+
+    // Returns the exit code the native executable would report
+    int run() {
+
+        const Instruction* code = bytecode.code.data();
+        const uint64_t* constants = bytecode.constants.data();
+        const FunctionInfo* functions = bytecode.functions.data();
+
+        registers.assign(functions[0].registers, 0);
+        frames.clear();
+
+        const Instruction* ip = code + functions[0].entry;
+        size_t base = 0;
+        uint32_t windowSize = functions[0].registers;
+        uint64_t* r = registers.data();
+
+#ifdef COMPUTED_GOTO
+        // Same order as OpCode
+        static const void* dispatchTable[] = {
+            &&LOAD_CONSTANT, &&MOVE,
+            &&ADD, &&SUBTRACT, &&MULTIPLY, &&DIVIDE,
+            &&JUMP, &&JUMP_IF_ZERO,
+            &&CALL, &&RETURN, &&EXIT
+        };
+        #define DISPATCH() goto *dispatchTable[static_cast<uint32_t>(ip->op)]
+        #define INSTRUCTION(name) name:
+        DISPATCH();
+#else
+        #define DISPATCH() break
+        #define INSTRUCTION(name) case OpCode::name:
+        while (true) switch (ip->op) {
+#endif
+
+        INSTRUCTION(LOAD_CONSTANT) {
+            r[ip->a] = constants[ip->b];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(MOVE) {
+            r[ip->a] = r[ip->b];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(ADD) {
+            r[ip->a] = r[ip->b] + r[ip->c];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(SUBTRACT) {
+            r[ip->a] = r[ip->b] - r[ip->c];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(MULTIPLY) {
+            r[ip->a] = r[ip->b] * r[ip->c];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(DIVIDE) {
+            if (r[ip->c] == 0) {
+                cerr << "Division by zero!" << endl;
+                exit(EXIT_FAILURE);
+            }
+            r[ip->a] = r[ip->b] / r[ip->c];
+            ip++;
+            DISPATCH();
+        }
+
+        INSTRUCTION(JUMP) {
+            ip = code + ip->a;
+            DISPATCH();
+        }
+
+        INSTRUCTION(JUMP_IF_ZERO) {
+            ip = r[ip->a] == 0 ? code + ip->b : ip + 1;
+            DISPATCH();
+        }
+
+        INSTRUCTION(CALL) {
+
+            const FunctionInfo& callee = functions[ip->b];
+            size_t calleeBase = base + windowSize;
+
+            frames.push_back({ .returnAddress = ip + 1, .base = base, .windowSize = windowSize, .result = ip->a });
+
+            // The register file may move, arguments are copied by index
+            registers.resize(max(registers.size(), calleeBase + callee.registers));
+            for (uint32_t i = 0; i < callee.parameters; i++) {
+                registers[calleeBase + i] = registers[base + ip->c + i];
+            }
+
+            base = calleeBase;
+            windowSize = callee.registers;
+            r = registers.data() + base;
+            ip = code + callee.entry;
+
+            DISPATCH();
+
+        }
+
+        INSTRUCTION(RETURN) {
+
+            uint64_t value = r[ip->a];
+            Frame frame = frames.back();
+            frames.pop_back();
+
+            base = frame.base;
+            windowSize = frame.windowSize;
+            r = registers.data() + base;
+            r[frame.result] = value;
+            ip = frame.returnAddress;
+
+            DISPATCH();
+
+        }
+
+        INSTRUCTION(EXIT) {
+            // The kernel only keeps the lowest byte of the status
+            return static_cast<int>(r[ip->a] & 0xFF);
+        }
+
+#ifndef COMPUTED_GOTO
+        }
+#endif
+
+        #undef DISPATCH
+        #undef INSTRUCTION
+        #undef COMPUTED_GOTO
+
+    }
+
+private:
+
+    struct Frame {
+        const Instruction* returnAddress;
+        size_t base;
+        uint32_t windowSize;
+        uint32_t result;
+    };
+
+    const Bytecode bytecode;
+
+    vector<uint64_t> registers {};
+    vector<Frame> frames {};
+};